@@ -22,6 +22,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
 typedef uint8_t   u8;
@@ -39,6 +40,7 @@ typedef struct Nptrans Nptrans;
 typedef struct Npconn Npconn;
 typedef struct Npreq Npreq;
 typedef struct Npwthread Npwthread;
+typedef struct Npreqqueue Npreqqueue;
 typedef struct Npauth Npauth;
 typedef struct Npsrv Npsrv;
 typedef struct Npuser Npuser;
@@ -225,6 +227,12 @@ struct Npfcall {
     u32     ecode;          /* Rerror */
     Npstr       extension;      /* Tcreate */
 
+    /* Rread sent from iov instead of pkt, see np_alloc_rread_iov */
+    struct iovec*   iov;
+    int     iovcnt;
+    void        (*release)(void *);
+    void*       releaseaux;
+
     Npfcall*    next;
 };
 
@@ -253,9 +261,13 @@ struct Nptrans {
     void*       aux;
     int     (*read)(u8 *, u32, void *);
     int     (*write)(u8 *, u32, void *);
+    int     (*writev)(struct iovec *, int, void *);
     void        (*destroy)(void *);
 };
 
+/* Buckets in a connection's table of outstanding requests by tag */
+#define NPTAGHASH   256
+
 struct Npconn {
     pthread_mutex_t lock;
     int     refcount;
@@ -271,9 +283,14 @@ struct Npconn {
     Nptrans*    trans;
     Npfid**     fidpool;
     int     freercnum;
+    int     freercmax;  /* incalls to keep on freerclist for reuse */
     Npfcall*    freerclist;
     void*       aux;
     pthread_t   rthread;
+    Npreqqueue* queue;  /* that the connection's requests go on */
+    pthread_mutex_t reqlock;    /* for tags and inflight */
+    Npreq*      tags[NPTAGHASH];/* requests read and not yet answered */
+    int     inflight;   /* how many */
 
     Npconn*     next;   /* list of connections within a server */
 };
@@ -293,16 +310,38 @@ struct Npreq {
     Npreq*      next;   /* list of all outstanding requests */
     Npreq*      prev;   /* used for requests that are worked on */
     Npwthread*  wthread;/* for requests that are worked on */
+    Npreqqueue* queue;  /* whose list the request is on */
+    int     state;      /* under the queue's lock */
+    Npreq*      tagnext;/* in the connection's tag table */
+};
+
+enum {
+    Npreqqueued,        /* waiting for a worker */
+    Npreqworking,
+    Npreqdropped,       /* flushed or reset before a worker took it */
 };
 
 struct Npwthread {
     Npsrv*      srv;
     int     shutdown;
     pthread_t   thread;
+    Npreqqueue* queue;  /* taken from first, then stolen from the others */
 
     Npwthread   *next;
 };
 
+/* A server has a request queue per CPU, each with its own lock, and spreads
+ * connections across them.  A worker thread takes requests from its own
+ * queue and, when that is empty, steals from the others before it sleeps. */
+struct Npreqqueue {
+    pthread_mutex_t lock;
+    pthread_cond_t  reqcond;
+    Npreq*      reqs_first; /* waiting for a worker */
+    Npreq*      reqs_last;
+    int     idle;       /* workers asleep, or about to be */
+    int     wakeups;    /* for idle workers to go looking for work */
+};
+
 struct Npauth {
     Npfcall*    (*auth)(Npfid *afid, Npstr *uname, Npstr *aname);
     Npfcall*    (*attach)(Npfid *afid, Npstr *uname, Npstr *aname);
@@ -341,18 +380,17 @@ struct Npsrv {
                 Npreq *req);
     Npfcall*    (*clunk)(Npfid *fid);
     Npfcall*    (*remove)(Npfid *fid);
-    Npfcall*    (*stat)(Npfid *fid);
+    Npfcall*    (*stat)(Npfid *fid, Npreq *req);
     Npfcall*    (*wstat)(Npfid *fid, Npstat *stat);
 
     /* implementation specific */
     pthread_mutex_t lock;
-    pthread_cond_t  reqcond;
     int     shuttingdown;
     Npconn*     conns;
     Npwthread*  wthreads;
-    Npreq*      reqs_first;
-    Npreq*      reqs_last;
-    Npreq*      workreqs;
+    Npreqqueue* queues;
+    int     nqueues;
+    int     nextqueue;  /* for the next connection */
 };
 
 struct Npuser {
@@ -408,6 +446,8 @@ struct Npfileops {
     void        (*destroy)(Npfile*);
     int     (*openfid)(Npfilefid *);
     void        (*closefid)(Npfilefid *);
+    Npfcall*    (*readv)(Npfilefid* file, u64 offset, u32 count,
+                Npreq *req);
 };
 
 struct Npdirops {
@@ -467,6 +507,8 @@ void np_conn_reset(Npconn *, u32, int);
 void np_conn_shutdown(Npconn *);
 void np_conn_respond(Npreq *req);
 void np_respond(Npreq *, Npfcall *);
+void np_respond_error(Npreq *, char *, int);
+Npfcall *np_req_adopt_tcall(Npreq *);
 
 Npfid **np_fidpool_create(void);
 void np_fidpool_destroy(Npfid **);
@@ -481,6 +523,7 @@ Nptrans *np_trans_create(void *aux, int (*read)(u8 *, u32, void *),
 void np_trans_destroy(Nptrans *);
 int np_trans_read(Nptrans *, u8 *, u32);
 int np_trans_write(Nptrans *, u8 *, u32);
+int np_trans_writev(Nptrans *, struct iovec *, int);
 
 int np_deserialize(Npfcall*, u8*, int dotu);
 int np_serialize_stat(Npwstat *wstat, u8* buf, int buflen, int dotu);
@@ -521,6 +564,9 @@ Npfcall *np_create_twstat(u32 fid, Npwstat *wstat, int dotu);
 Npfcall *np_create_rwstat(void);
 Npfcall * np_alloc_rread(u32);
 void np_set_rread_count(Npfcall *, u32);
+Npfcall *np_alloc_rread_iov(int);
+void np_set_rread_iov(Npfcall *, u32, int, void (*)(void *), void *);
+void np_free_fcall(Npfcall *);
 
 int np_printstat(FILE *f, Npstat *st, int dotu);
 int np_printfcall(FILE *f, Npfcall *fc, int dotu);
@@ -533,7 +579,10 @@ int np_usergroups(Npuser *u, gid_t **gids);
 int np_change_user(Npuser *u);
 
 Nptrans *np_fdtrans_create(int, int);
-Npsrv *np_socksrv_create_tcp(int, int*);
+Npsrv *np_socksrv_create_tcp(int, int, int*);
+Nppoll *np_poll_create(Npsrv *, int);
+void np_poll_destroy(Nppoll *);
+int np_poll_add(Nppoll *, int);
 Npsrv *np_pipesrv_create(int nwthreads);
 int np_pipesrv_mount(Npsrv *srv, char *mntpt, char *user, int mntflags, char *opts);
 
@@ -560,5 +609,5 @@ Npfcall *npfile_read(Npfid *fid, u64 offset, u32 count, Npreq *req);
 Npfcall *npfile_write(Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req);
 Npfcall *npfile_clunk(Npfid *fid);
 Npfcall *npfile_remove(Npfid *fid);
-Npfcall *npfile_stat(Npfid *fid);
+Npfcall *npfile_stat(Npfid *fid, Npreq *req);
 Npfcall *npfile_wstat(Npfid *fid, Npstat *stat);
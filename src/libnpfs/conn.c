@@ -33,8 +33,7 @@
 
 extern int printfcall(FILE *f, Npfcall *fc, int dotu);
 
-static Npfcall *np_conn_new_incall(Npconn *conn);
-static void np_conn_free_incall(Npconn *, Npfcall *);
+static int np_conn_remove_req(Npconn *conn, Npreq *req);
 static void *np_conn_read_proc(void *);
 
 Npconn*
@@ -42,12 +41,27 @@ np_conn_create(Npsrv *srv, Nptrans *trans)
 {
     Npconn *conn;
 
+    conn = np_conn_alloc(srv, trans);
+    if (!conn)
+        return NULL;
+
+    pthread_create(&conn->rthread, NULL, np_conn_read_proc, conn);
+    return conn;
+}
+
+/* A connection added to the server with nothing reading it yet */
+Npconn*
+np_conn_alloc(Npsrv *srv, Nptrans *trans)
+{
+    Npconn *conn;
+
     conn = malloc(sizeof(*conn));
     if (!conn)
         return NULL;
 
     //fprintf(stderr, "np_conn_create %p\n", conn);
     pthread_mutex_init(&conn->lock, NULL);
+    pthread_mutex_init(&conn->reqlock, NULL);
     pthread_cond_init(&conn->resetcond, NULL);
     pthread_cond_init(&conn->resetdonecond, NULL);
     conn->refcount = 0;
@@ -60,10 +74,13 @@ np_conn_create(Npsrv *srv, Nptrans *trans)
     conn->trans = trans;
     conn->aux = NULL;
     conn->freercnum = 0;
+    conn->freercmax = 64;
     conn->freerclist = NULL;
+    conn->queue = NULL;
+    memset(conn->tags, 0, sizeof(conn->tags));
+    conn->inflight = 0;
     np_srv_add_conn(srv, conn);
 
-    pthread_create(&conn->rthread, NULL, np_conn_read_proc, conn);
     return conn;
 }
 
@@ -103,6 +120,7 @@ np_conn_decref(Npconn *conn)
 
     pthread_mutex_unlock(&conn->lock);
     pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->reqlock);
     free(conn);
 }
 
@@ -157,12 +175,8 @@ again:
         n -= size;
 
         req = np_req_alloc(conn, fc);
-        pthread_mutex_lock(&srv->lock);
-        if (!conn->resetting)
-            np_srv_add_req(srv, req);
-        else
+        if (!np_srv_add_req(srv, req))
             np_req_unref(req);
-        pthread_mutex_unlock(&srv->lock);
         fc = fc1;
         if (n > 0)
             goto again;
@@ -188,49 +202,41 @@ again:
 void
 np_conn_reset(Npconn *conn, u32 msize, int dotu)
 {
-    int i, n;
-    Npsrv *srv;
+    int i, n, keep;
     Npreq *req, *req1, *preqs, **reqs;
+    Npreqqueue *q;
     Npfcall *fc, *fc1;
 
     pthread_mutex_lock(&conn->lock);
     conn->resetting = 1;
     pthread_mutex_unlock(&conn->lock);
 
-    pthread_mutex_lock(&conn->srv->lock);
-    srv = conn->srv;
-    // first flush all outstanding requests
+    // drop the requests no worker has taken, and flush the working ones,
+    // all of which are in the connection's tag table
+    q = conn->queue;
     preqs = NULL;
-    req = srv->reqs_first;
-    while (req != NULL) {
-        req1 = req->next;
-        if (req->conn == conn) {
-            np_srv_remove_req(srv, req);
-            req->next = preqs;
-            preqs = req;
-        }
-        req = req1;
-    }
-
-    // then flush all working requests
+    pthread_mutex_lock(&conn->reqlock);
+    reqs = malloc(conn->inflight * sizeof(Npreq *));
     n = 0;
-    req = conn->srv->workreqs;
-    while (req != NULL) {
-        if (req->conn == conn && (msize==0 || req->tcall->type != Tversion))
-            n++;
-
-        req = req->next;
-    }
-
-    reqs = malloc(n * sizeof(Npreq *));
-    n = 0;
-    req = conn->srv->workreqs;
-    while (req != NULL) {
-        if (req->conn == conn && (msize==0 || req->tcall->type != Tversion))
-            reqs[n++] = np_req_ref(req);
-        req = req->next;
+    keep = 0;
+    for(i = 0; i < NPTAGHASH; i++) {
+        for(req = conn->tags[i]; req != NULL; req = req->tagnext) {
+            pthread_mutex_lock(&q->lock);
+            if (req->state == Npreqqueued) {
+                np_srv_remove_req(q, req);
+                req->state = Npreqdropped;
+                req->next = preqs;
+                preqs = req;
+            } else if (req->state == Npreqworking) {
+                if (msize==0 || !req->tcall || req->tcall->type != Tversion)
+                    reqs[n++] = np_req_ref(req);
+                else
+                    keep++;
+            }
+            pthread_mutex_unlock(&q->lock);
+        }
     }
-    pthread_mutex_unlock(&conn->srv->lock);
+    pthread_mutex_unlock(&conn->reqlock);
 
     req = preqs;
     while (req != NULL) {
@@ -246,37 +252,18 @@ np_conn_reset(Npconn *conn, u32 msize, int dotu)
             (*req->conn->srv->flush)(req);
     }
 
-    /* wait until all working requests finish */
-/*
-    pthread_mutex_lock(&conn->lock);
-    while (1) {
-        for(i = 0; i < n; i++)
-            if (!reqs[i]->responded)
-                break;
-
-        if (i >= n)
-            break;
-
-        pthread_cond_wait(&conn->resetcond, &conn->lock);
-    }
-*/
-    pthread_mutex_lock(&srv->lock);
-    while (1) {
-        for(req = srv->workreqs; req != NULL; req = req->next)
-            if (req->conn == conn && (msize==0 || req->tcall->type != Tversion))
-                break;
-
-        if (req == NULL)
-            break;
-
-        while(conn->resetting)
-            pthread_cond_wait(&conn->resetcond, &srv->lock);
-    }
-    pthread_mutex_unlock(&srv->lock);
+    /* wait until all working requests but the Tversion finish */
+    pthread_mutex_lock(&conn->reqlock);
+    while (conn->inflight > keep)
+        pthread_cond_wait(&conn->resetcond, &conn->reqlock);
+    pthread_mutex_unlock(&conn->reqlock);
 
     /* free old pool of fcalls */
+    pthread_mutex_lock(&conn->reqlock);
     fc = conn->freerclist;
     conn->freerclist = NULL;
+    conn->freercnum = 0;
+    pthread_mutex_unlock(&conn->reqlock);
     while (fc != NULL) {
         fc1 = fc->next;
         free(fc);
@@ -288,6 +275,7 @@ np_conn_reset(Npconn *conn, u32 msize, int dotu)
         conn->fidpool = NULL;
     }
 
+    pthread_mutex_lock(&conn->lock);
     if (msize) {
         conn->dotu = dotu;
         conn->resetting = 0;
@@ -334,7 +322,10 @@ np_conn_respond(Npreq *req)
             np_printfcall(stderr, rc, conn->dotu);
             fprintf(stderr, "\n");
         }
-        n = np_trans_write(conn->trans, rc->pkt, rc->size);
+        if (rc->iov)
+            n = np_trans_writev(conn->trans, rc->iov, rc->iovcnt);
+        else
+            n = np_trans_write(conn->trans, rc->pkt, rc->size);
         if (n <= 0) {
             trans = conn->trans;
             conn->trans = NULL;
@@ -342,32 +333,77 @@ np_conn_respond(Npreq *req)
     }
 
     np_conn_free_incall(req->conn, req->tcall);
-    free(req->rcall);
+    np_free_fcall(req->rcall);
     req->tcall = NULL;
     req->rcall = NULL;
-    pthread_mutex_unlock(&conn->lock);
-
-    if (conn->resetting) {
-        pthread_mutex_lock(&conn->srv->lock);
+    pthread_mutex_lock(&conn->reqlock);
+    if (np_conn_remove_req(conn, req) && conn->resetting)
         pthread_cond_broadcast(&conn->resetcond);
-        pthread_mutex_unlock(&conn->srv->lock);
-    }
+    pthread_mutex_unlock(&conn->reqlock);
+    pthread_mutex_unlock(&conn->lock);
 
     if (trans)
         np_trans_destroy(trans); /* np_conn_read_proc will take care of resetting */
 }
 
-static Npfcall *
+/* Add a request read from the connection to its tag table, under reqlock */
+void
+np_conn_add_req(Npconn *conn, Npreq *req)
+{
+    Npreq **bucket;
+
+    bucket = &conn->tags[req->tag % NPTAGHASH];
+    req->tagnext = *bucket;
+    *bucket = req;
+    conn->inflight++;
+}
+
+/* Take an answered request out of the tag table, under reqlock.  Returns 0
+ * if it was not there. */
+static int
+np_conn_remove_req(Npconn *conn, Npreq *req)
+{
+    Npreq **preq;
+
+    for(preq = &conn->tags[req->tag % NPTAGHASH]; *preq != NULL;
+        preq = &(*preq)->tagnext) {
+        if (*preq == req) {
+            *preq = req->tagnext;
+            req->tagnext = NULL;
+            conn->inflight--;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* The outstanding request with the tag, with a reference, or NULL */
+Npreq *
+np_conn_find_req(Npconn *conn, u16 tag)
+{
+    Npreq *req;
+
+    pthread_mutex_lock(&conn->reqlock);
+    for(req = conn->tags[tag % NPTAGHASH]; req != NULL; req = req->tagnext)
+        if (req->tag == tag)
+            break;
+    if (req)
+        np_req_ref(req);
+    pthread_mutex_unlock(&conn->reqlock);
+
+    return req;
+}
+
+/* An fcall with room for a message of msize.  The free list is under
+ * reqlock rather than lock, so reading a message never waits for a reply
+ * being written. */
+Npfcall *
 np_conn_new_incall(Npconn *conn)
 {
     Npfcall *fc;
 
-    pthread_mutex_lock(&conn->lock);
-//  if (!conn->trans) {
-//      pthread_mutex_unlock(&conn->lock);
-//      return NULL;
-//  }
-
+    pthread_mutex_lock(&conn->reqlock);
     if (conn->freerclist) {
         fc = conn->freerclist;
         conn->freerclist = fc->next;
@@ -375,31 +411,29 @@ np_conn_new_incall(Npconn *conn)
     } else {
         fc = malloc(sizeof(*fc) + conn->msize);
     }
+    pthread_mutex_unlock(&conn->reqlock);
 
-    if (!fc) {
-        pthread_mutex_unlock(&conn->lock);
+    if (!fc)
         return NULL;
-    }
 
     fc->pkt = (u8*) fc + sizeof(*fc);
-    pthread_mutex_unlock(&conn->lock);
-
     return fc;
 }
 
-static void
+void
 np_conn_free_incall(Npconn* conn, Npfcall *rc)
 {
     if (!rc)
         return;
 
-//  pthread_mutex_lock(&conn->lock);
-    if (conn->freercnum < 64) {
+    pthread_mutex_lock(&conn->reqlock);
+    if (conn->freercnum < conn->freercmax) {
         rc->next = conn->freerclist;
         conn->freerclist = rc;
+        conn->freercnum++;
         rc = NULL;
     }
-//  pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_unlock(&conn->reqlock);
 
     if (rc)
         free(rc);
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <errno.h>
 #include "npfs.h"
@@ -43,6 +44,7 @@ struct Fdtrans {
 
 static int np_fdtrans_read(u8 *data, u32 count, void *a);
 static int np_fdtrans_write(u8 *data, u32 count, void *a);
+static int np_fdtrans_writev(struct iovec *iov, int iovcnt, void *a);
 static void np_fdtrans_destroy(void *);
 
 Nptrans *
@@ -65,6 +67,7 @@ np_fdtrans_create(int fdin, int fdout)
         free(fdt);
         return NULL;
     }
+    npt->writev = np_fdtrans_writev;
 
     return npt;
 }
@@ -104,3 +107,34 @@ np_fdtrans_write(u8 *data, u32 count, void *a)
 //  fprintf(stderr, "np_fdtrans_write fd %d datalen %d count %d\n", fdt->fdout, count, ret);
     return ret;
 }
+
+static int
+np_fdtrans_writev(struct iovec *iov, int iovcnt, void *a)
+{
+    Fdtrans *fdt;
+    int n, ret;
+
+    fdt = a;
+    ret = 0;
+    while (iovcnt > 0) {
+        n = writev(fdt->fdout, iov, iovcnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n;
+
+        /* skip over what was written, the iov is ours to modify */
+        ret += n;
+        while (iovcnt > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (u8 *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return ret;
+}
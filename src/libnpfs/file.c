@@ -514,7 +514,10 @@ npfile_open(Npfid *fid, u8 mode)
 
             blank_stat(&stat);
             stat.length = 0;
-            if (!(*fops->wstat)(file, &stat))
+            pthread_mutex_lock(&file->lock);
+            m = (*fops->wstat)(file, &stat);
+            pthread_mutex_unlock(&file->lock);
+            if (!m)
                 goto done;
         }
 
@@ -639,8 +642,18 @@ npfile_read(Npfid *fid, u64 offset, u32 count, Npreq *req)
 
     ret = NULL;
     f = fid->aux;
-    ret = np_alloc_rread(count);
     file = f->file;
+    fops = file->ops;
+    if (!(file->mode & Dmdir) && fops->readv) {
+        ret = (*fops->readv)(f, offset, count, req);
+
+        pthread_mutex_lock(&file->lock);
+        file->atime = time(NULL);
+        pthread_mutex_unlock(&file->lock);
+        goto done;
+    }
+
+    ret = np_alloc_rread(count);
     if (file->mode & Dmdir) {
         pthread_mutex_lock(&file->lock);
         dops = file->ops;
@@ -678,7 +691,6 @@ npfile_read(Npfid *fid, u64 offset, u32 count, Npreq *req)
         file->atime = time(NULL);
         pthread_mutex_unlock(&file->lock);
     } else {
-        fops = file->ops;
         if (!fops->read) {
             np_werror(Eperm, EPERM);
             goto done;
@@ -803,7 +815,7 @@ done:
 }
 
 Npfcall*
-npfile_stat(Npfid *fid)
+npfile_stat(Npfid *fid, Npreq *req)
 {
     Npfilefid *f;
     Npfile *file;
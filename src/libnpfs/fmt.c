@@ -251,7 +251,11 @@ np_printfcall(FILE *f, Npfcall *fc, int dotu)
 
     case Rread:
         ret += fprintf(f, "Rread tag %u count %u data ", tag, fc->count);
-        ret += np_printdata(f, fc->data, fc->count);
+        /* only the first segment of an iov Rread is contiguous */
+        if (fc->iov && fc->iovcnt > 1)
+            ret += np_printdata(f, fc->data, fc->iov[1].iov_len);
+        else if (!fc->iov)
+            ret += np_printdata(f, fc->data, fc->count);
         break;
 
     case Twrite:
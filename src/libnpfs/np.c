@@ -370,6 +370,10 @@ np_create_common(struct cbuf *bufp, u32 size, u8 id)
         return NULL;
 
     fc->pkt = (u8 *) fc + sizeof(*fc);
+    fc->iov = NULL;
+    fc->iovcnt = 0;
+    fc->release = NULL;
+    fc->releaseaux = NULL;
     buf_init(bufp, (char *) fc->pkt, size);
     buf_put_int32(bufp, size, &fc->size);
     buf_put_int8(bufp, id, &fc->type);
@@ -378,6 +382,18 @@ np_create_common(struct cbuf *bufp, u32 size, u8 id)
     return fc;
 }
 
+void
+np_free_fcall(Npfcall *fc)
+{
+    if (!fc)
+        return;
+
+    if (fc->release)
+        (*fc->release)(fc->releaseaux);
+
+    free(fc);
+}
+
 static Npfcall *
 np_post_check(Npfcall *fc, struct cbuf *bufp)
 {
@@ -813,6 +829,62 @@ np_set_rread_count(Npfcall *fc, u32 count)
     buf_put_int32(bufp, count, &fc->count);
 }
 
+/* An Rread whose data is not copied into the message.  Only the header lives
+ * in pkt; the caller points iov[1..iovcnt] at the data and calls
+ * np_set_rread_iov, and the release function is called once the message has
+ * been sent or dropped. */
+Npfcall *
+np_alloc_rread_iov(int iovcnt)
+{
+    int size;
+    Npfcall *fc;
+    struct cbuf buffer;
+    struct cbuf *bufp;
+
+    bufp = &buffer;
+    size = 4 + 1 + 2 + 4; /* size[4] id[1] tag[2] count[4] */
+    fc = malloc(sizeof(*fc) + (iovcnt + 1) * sizeof(struct iovec) + size);
+    if (!fc)
+        return NULL;
+
+    fc->iov = (struct iovec *) ((u8 *) fc + sizeof(*fc));
+    fc->iovcnt = 1;
+    fc->pkt = (u8 *) (fc->iov + iovcnt + 1);
+    fc->data = NULL;
+    fc->release = NULL;
+    fc->releaseaux = NULL;
+    buf_init(bufp, (char *) fc->pkt, size);
+    buf_put_int32(bufp, size, &fc->size);
+    buf_put_int8(bufp, Rread, &fc->type);
+    buf_put_int16(bufp, NOTAG, &fc->tag);
+    buf_put_int32(bufp, 0, &fc->count);
+    fc->iov[0].iov_base = fc->pkt;
+    fc->iov[0].iov_len = size;
+
+    return np_post_check(fc, bufp);
+}
+
+void
+np_set_rread_iov(Npfcall *fc, u32 count, int iovcnt,
+    void (*release)(void *), void *aux)
+{
+    int size;
+    struct cbuf buffer;
+    struct cbuf *bufp;
+
+    bufp = &buffer;
+    size = 4 + 1 + 2 + 4 + count; /* size[4] id[1] tag[2] count[4] data[count] */
+
+    buf_init(bufp, (char *) fc->pkt, 4);
+    buf_put_int32(bufp, size, &fc->size);
+    buf_init(bufp, (char *) fc->pkt + 7, 4);
+    buf_put_int32(bufp, count, &fc->count);
+    fc->iovcnt = iovcnt + 1;
+    fc->data = iovcnt ? fc->iov[1].iov_base : NULL;
+    fc->release = release;
+    fc->releaseaux = aux;
+}
+
 Npfcall *
 np_create_twrite(u32 fid, u64 offset, u32 count, u8 *data)
 {
@@ -27,9 +27,13 @@ Npreq *np_req_alloc(Npconn *conn, Npfcall *tc);
 Npreq *np_req_ref(Npreq *);
 void np_req_unref(Npreq *);
 
-void np_srv_add_req(Npsrv *srv, Npreq *req);
-void np_srv_remove_req(Npsrv *srv, Npreq *req);
-void np_srv_add_workreq(Npsrv *srv, Npreq *req);
-void np_srv_remove_workreq(Npsrv *srv, Npreq *req);
+int np_srv_add_req(Npsrv *srv, Npreq *req);
+void np_srv_remove_req(Npreqqueue *q, Npreq *req);
+
+Npconn *np_conn_alloc(Npsrv *srv, Nptrans *trans);
+Npfcall *np_conn_new_incall(Npconn *conn);
+void np_conn_free_incall(Npconn *conn, Npfcall *fc);
+void np_conn_add_req(Npconn *conn, Npreq *req);
+Npreq *np_conn_find_req(Npconn *conn, u16 tag);
 
 int np_mount(char *mntpt, int mntflags, char *opts);
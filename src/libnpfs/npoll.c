@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * LATCHESAR IONKOV AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "npfs.h"
+#include "npfsimpl.h"
+
+/*
+ * Connections read by a few poll threads instead of a thread each.  Every
+ * poll thread waits on its own epoll set, so a connection is only ever read
+ * by one of them and no buffer is kept for it between messages.  Replies are
+ * still written by the workers, which wait for room in the socket when it
+ * is full.
+ */
+
+#ifdef __linux__
+
+#define POLLEVENTS  64
+
+typedef struct Pollthread Pollthread;
+
+/* Shared by the poll thread and the connection's transport, the fd is
+ * closed when both are done with it */
+struct Npollfd {
+    int         fd;
+    int         refcount;
+    Npconn*     conn;
+    u8          hdr[4]; /* size of the message being read */
+    Npfcall*    fc;     /* message partly read, or NULL until its size is */
+    u32         n;      /* bytes of it read */
+};
+
+struct Pollthread {
+    Nppoll*     poll;
+    int         epfd;
+    int         wakefd[2];  /* written to stop the thread */
+    u8*         buf;
+    u32         bufsize;
+    pthread_t   thread;
+};
+
+struct Nppoll {
+    Npsrv*      srv;
+    int         nthreads;
+    Pollthread* threads;
+    int         next;       /* thread the next connection goes to */
+    int         running;
+    int         shutdown;
+};
+
+static void *np_poll_proc(void *a);
+static int np_pollfd_write(u8 *data, u32 count, void *a);
+static int np_pollfd_writev(struct iovec *iov, int iovcnt, void *a);
+static void np_pollfd_destroy(void *a);
+static void np_pollfd_unref(Npollfd *pfd);
+
+Nppoll *
+np_poll_create(Npsrv *srv, int nthreads)
+{
+    int i, n, err;
+    Nppoll *p;
+    Pollthread *t;
+    struct epoll_event ev;
+
+    p = malloc(sizeof(*p));
+    if (!p) {
+        np_uerror(ENOMEM);
+        return NULL;
+    }
+
+    p->srv = srv;
+    p->nthreads = nthreads;
+    p->next = 0;
+    p->running = nthreads;
+    p->shutdown = 0;
+    p->threads = calloc(nthreads, sizeof(Pollthread));
+    if (!p->threads) {
+        np_uerror(ENOMEM);
+        free(p);
+        return NULL;
+    }
+
+    for(i = 0; i < nthreads; i++) {
+        t = &p->threads[i];
+        t->poll = p;
+        t->buf = NULL;
+        t->bufsize = 0;
+        t->epfd = epoll_create(POLLEVENTS);
+        if (t->epfd < 0)
+            goto error;
+
+        if (pipe(t->wakefd) < 0) {
+            close(t->epfd);
+            goto error;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wakefd[0], &ev) < 0) {
+            close(t->wakefd[0]);
+            close(t->wakefd[1]);
+            close(t->epfd);
+            goto error;
+        }
+    }
+
+    /* make do with the threads that could be started */
+    for(i = 0; i < nthreads; i++)
+        if ((err = pthread_create(&p->threads[i].thread, NULL, np_poll_proc,
+            &p->threads[i])))
+            break;
+
+    if (i < nthreads) {
+        n = i;
+        for(; i < nthreads; i++) {
+            t = &p->threads[i];
+            close(t->wakefd[0]);
+            close(t->wakefd[1]);
+            close(t->epfd);
+        }
+
+        if (n == 0) {
+            np_uerror(err);
+            free(p->threads);
+            free(p);
+            return NULL;
+        }
+
+        p->nthreads = n;
+        __sync_sub_and_fetch(&p->running, nthreads - n);
+    }
+
+    return p;
+
+error:
+    np_uerror(errno);
+    while (--i >= 0) {
+        t = &p->threads[i];
+        close(t->wakefd[0]);
+        close(t->wakefd[1]);
+        close(t->epfd);
+    }
+    free(p->threads);
+    free(p);
+    return NULL;
+}
+
+/* Stop the poll threads once the server has no connections left; the last
+ * one to go frees the rest */
+void
+np_poll_destroy(Nppoll *p)
+{
+    int i;
+
+    p->shutdown = 1;
+    for(i = 0; i < p->nthreads; i++)
+        if (write(p->threads[i].wakefd[1], "", 1) < 0)
+            fprintf(stderr, "cannot stop poll thread: %d\n", errno);
+}
+
+/* Serve the connected socket fd from one of the poll threads.  The fd is
+ * the connection's from now on, even if this fails. */
+int
+np_poll_add(Nppoll *p, int fd)
+{
+    int flags;
+    Npollfd *pfd;
+    Nptrans *trans;
+    Pollthread *t;
+    struct epoll_event ev;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        np_uerror(errno);
+        close(fd);
+        return -1;
+    }
+
+    pfd = malloc(sizeof(*pfd));
+    if (!pfd) {
+        np_uerror(ENOMEM);
+        close(fd);
+        return -1;
+    }
+
+    pfd->fd = fd;
+    pfd->refcount = 2;  /* the poll thread and the transport */
+    pfd->fc = NULL;
+    pfd->n = 0;
+    trans = np_trans_create(pfd, NULL, np_pollfd_write, np_pollfd_destroy);
+    if (!trans) {
+        np_uerror(ENOMEM);
+        close(fd);
+        free(pfd);
+        return -1;
+    }
+    trans->writev = np_pollfd_writev;
+
+    pfd->conn = np_conn_alloc(p->srv, trans);
+    if (!pfd->conn) {
+        np_uerror(ENOMEM);
+        np_trans_destroy(trans);
+        np_pollfd_unref(pfd);
+        return -1;
+    }
+    np_conn_incref(pfd->conn);
+    pfd->conn->freercmax = 0;   /* incalls are sized to their message */
+
+    t = &p->threads[__sync_fetch_and_add(&p->next, 1) % p->nthreads];
+    ev.events = EPOLLIN;
+    ev.data.ptr = pfd;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        np_uerror(errno);
+        np_conn_shutdown(pfd->conn);
+        np_srv_remove_conn(p->srv, pfd->conn);
+        np_conn_decref(pfd->conn);
+        np_pollfd_unref(pfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+np_pollfd_unref(Npollfd *pfd)
+{
+    if (__sync_sub_and_fetch(&pfd->refcount, 1))
+        return;
+
+    close(pfd->fd);
+    free(pfd);
+}
+
+/* Hand a whole message to the workers.  Returns 0 if it does not parse. */
+static int
+np_pollfd_dispatch(Npollfd *pfd, Npfcall *fc)
+{
+    Npconn *conn;
+    Npreq *req;
+
+    conn = pfd->conn;
+    if (!np_deserialize(fc, fc->pkt, conn->dotu)) {
+        np_conn_free_incall(conn, fc);
+        return 0;
+    }
+
+    if (conn->srv->debuglevel) {
+        fprintf(stderr, "<<< (%p) ", conn);
+        np_printfcall(stderr, fc, conn->dotu);
+        fprintf(stderr, "\n");
+    }
+
+    req = np_req_alloc(conn, fc);
+    if (!np_srv_add_req(conn->srv, req)) {
+        /* input that arrives during a reset is dropped */
+        np_conn_free_incall(conn, fc);
+        req->tcall = NULL;
+        np_req_unref(req);
+    }
+
+    return 1;
+}
+
+/* Read what is waiting on the connection and pass on the messages it
+ * completes.  Returns -1 when the connection should be closed. */
+static int
+np_pollfd_read(Pollthread *t, Npollfd *pfd)
+{
+    int len;
+    u32 m, size;
+    u8 *p;
+    Npconn *conn;
+    Npfcall *fc;
+
+    conn = pfd->conn;
+    if (t->bufsize < conn->msize) {
+        p = realloc(t->buf, conn->msize);
+        if (!p)
+            return -1;
+
+        t->buf = p;
+        t->bufsize = conn->msize;
+    }
+
+    len = read(pfd->fd, t->buf, t->bufsize);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (len <= 0)
+        return -1;
+
+    p = t->buf;
+    while (len > 0) {
+        /* the size first, so that an idle connection holds no more than
+         * the message it is in the middle of */
+        if (pfd->n < 4) {
+            m = 4 - pfd->n;
+            if (m > (u32) len)
+                m = len;
+            memcpy(pfd->hdr + pfd->n, p, m);
+            pfd->n += m;
+            p += m;
+            len -= m;
+            if (pfd->n < 4)
+                break;
+        }
+
+        size = pfd->hdr[0] | (pfd->hdr[1]<<8) | (pfd->hdr[2]<<16) | (pfd->hdr[3]<<24);
+        if (!pfd->fc) {
+            if (size < 7 || size > conn->msize)
+                return -1;
+
+            pfd->fc = malloc(sizeof(*pfd->fc) + size);
+            if (!pfd->fc)
+                return -1;
+
+            pfd->fc->pkt = (u8*) pfd->fc + sizeof(*pfd->fc);
+            memcpy(pfd->fc->pkt, pfd->hdr, 4);
+        }
+
+        /* then the rest of the message */
+        fc = pfd->fc;
+        m = size - pfd->n;
+        if (m > (u32) len)
+            m = len;
+        memcpy(fc->pkt + pfd->n, p, m);
+        pfd->n += m;
+        p += m;
+        len -= m;
+
+        if (pfd->n < size)
+            continue;
+
+        pfd->fc = NULL;
+        pfd->n = 0;
+        if (!np_pollfd_dispatch(pfd, fc))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Tear the connection down like np_conn_read_proc does when its read fails */
+static void
+np_pollfd_close(Pollthread *t, Npollfd *pfd)
+{
+    Npconn *conn;
+    Nptrans *trans;
+
+    conn = pfd->conn;
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, pfd->fd, NULL);
+
+    /* fail any write a worker is waiting to finish, it holds the lock */
+    shutdown(pfd->fd, SHUT_RDWR);
+
+    pthread_mutex_lock(&conn->lock);
+    trans = conn->trans;
+    conn->trans = NULL;
+    pthread_mutex_unlock(&conn->lock);
+    np_conn_free_incall(conn, pfd->fc);
+    pfd->fc = NULL;
+
+    np_srv_remove_conn(conn->srv, conn);
+    np_conn_reset(conn, 0, 0);
+
+    if (trans)
+        np_trans_destroy(trans);
+
+    np_conn_decref(conn);
+    np_pollfd_unref(pfd);
+}
+
+static void *
+np_poll_proc(void *a)
+{
+    int i, n;
+    Pollthread *t;
+    Nppoll *p;
+    Npollfd *pfd;
+    struct epoll_event ev[POLLEVENTS];
+
+    pthread_detach(pthread_self());
+    t = a;
+    p = t->poll;
+    while (!p->shutdown) {
+        n = epoll_wait(t->epfd, ev, POLLEVENTS, -1);
+        for(i = 0; i < n; i++) {
+            pfd = ev[i].data.ptr;
+            if (!pfd)
+                continue;   /* woken up to check for shutdown */
+
+            if (np_pollfd_read(t, pfd) < 0)
+                np_pollfd_close(t, pfd);
+        }
+    }
+
+    close(t->wakefd[0]);
+    close(t->wakefd[1]);
+    close(t->epfd);
+    free(t->buf);
+    if (__sync_sub_and_fetch(&p->running, 1) == 0) {
+        free(p->threads);
+        free(p);
+    }
+
+    return NULL;
+}
+
+/* Wait for room in the socket, which is non-blocking for the poll thread */
+static int
+np_pollfd_wait(Npollfd *pfd)
+{
+    struct pollfd fds;
+
+    fds.fd = pfd->fd;
+    fds.events = POLLOUT;
+    fds.revents = 0;
+    if (poll(&fds, 1, -1) < 0 && errno != EINTR)
+        return -1;
+
+    return 0;
+}
+
+static int
+np_pollfd_write(u8 *data, u32 count, void *a)
+{
+    struct iovec iov;
+
+    iov.iov_base = data;
+    iov.iov_len = count;
+    return np_pollfd_writev(&iov, 1, a);
+}
+
+static int
+np_pollfd_writev(struct iovec *iov, int iovcnt, void *a)
+{
+    int n, ret;
+    Npollfd *pfd;
+    struct msghdr msg;
+
+    pfd = a;
+    ret = 0;
+    while (iovcnt > 0) {
+        /* no SIGPIPE if the client is gone, the write just fails */
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        n = sendmsg(pfd->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (np_pollfd_wait(pfd) < 0)
+                return -1;
+            continue;
+        }
+        if (n <= 0)
+            return n;
+
+        /* skip over what was written, the iov is ours to modify */
+        ret += n;
+        while (iovcnt > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (u8 *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return ret;
+}
+
+/* The poll thread notices the shutdown and closes the connection */
+static void
+np_pollfd_destroy(void *a)
+{
+    Npollfd *pfd;
+
+    pfd = a;
+    shutdown(pfd->fd, SHUT_RDWR);
+    np_pollfd_unref(pfd);
+}
+
+#else /* !__linux__ */
+
+Nppoll *
+np_poll_create(Npsrv *srv, int nthreads)
+{
+    np_werror("poll threads need epoll", ENOSYS);
+    return NULL;
+}
+
+void
+np_poll_destroy(Nppoll *p)
+{
+}
+
+int
+np_poll_add(Nppoll *p, int fd)
+{
+    close(fd);
+    np_werror("poll threads need epoll", ENOSYS);
+    return -1;
+}
+
+#endif
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <errno.h>
 #include "npfs.h"
@@ -46,6 +47,7 @@ struct Socksrv {
     int         shutdown;
 //  struct sockaddr*    addr;
     pthread_t       listenproc;
+    Nppoll*     poll;       /* reads the connections, or NULL */
 };
 
 static void np_socksrv_start(Npsrv *srv);
@@ -63,6 +65,7 @@ np_socksrv_create_common(int domain, int type, int proto)
     ss->type = type;
     ss->proto = proto;
     ss->shutdown = 0;
+    ss->poll = NULL;
     ss->sock = socket(domain, type, proto);
     if (ss->sock < 0) {
         fprintf(stderr, "cannot create socket: %d\n", errno);
@@ -90,8 +93,10 @@ np_socksrv_connect(Socksrv *ss)
     return 0;
 }
 
+/* Connections are read by npollthreads poll threads, or by a thread each
+ * if it is 0 */
 Npsrv*
-np_socksrv_create_tcp(int nwthreads, int *port)
+np_socksrv_create_tcp(int nwthreads, int npollthreads, int *port)
 {
     socklen_t n;
     Npsrv *srv;
@@ -116,6 +121,16 @@ np_socksrv_create_tcp(int nwthreads, int *port)
     *port = ntohs(saddr->sin_port);
 
     srv = np_srv_create(nwthreads);
+    if (npollthreads > 0) {
+        ss->poll = np_poll_create(srv, npollthreads);
+        if (!ss->poll) {
+            close(ss->sock);
+            free(saddr);
+            free(ss);
+            return NULL;
+        }
+    }
+
     srv->srvaux = ss;
     srv->start = np_socksrv_start;
     srv->shutdown = np_socksrv_shutdown;
@@ -162,6 +177,8 @@ np_socksrv_destroy(Npsrv *srv)
 
     ss = srv->srvaux;
     pthread_join(ss->listenproc, &ret);
+    if (ss->poll)
+        np_poll_destroy(ss->poll);
     free(ss);
     srv->srvaux = NULL;
 }
@@ -169,7 +186,7 @@ np_socksrv_destroy(Npsrv *srv)
 static void *
 np_socksrv_listenproc(void *a)
 {
-    int csock;
+    int csock, one;
     Npsrv *srv;
     Socksrv *ss;
     struct sockaddr_in caddr;
@@ -195,6 +212,19 @@ np_socksrv_listenproc(void *a)
             continue;
         }
 
+        /* replies go out as soon as they are ready, not when the client
+         * gets around to acknowledging the previous one */
+        if (ss->domain == PF_INET) {
+            one = 1;
+            setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        if (ss->poll) {
+            if (np_poll_add(ss->poll, csock) < 0)
+                fprintf(stderr, "cannot add connection\n");
+            continue;
+        }
+
         trans = np_fdtrans_create(csock, csock);
         conn = np_conn_create(srv, trans);
     }
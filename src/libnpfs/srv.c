@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
 #include <assert.h>
@@ -55,9 +56,8 @@ char *Eexist = "file or directory already exists";
 char *Enotempty = "directory not empty";
 char *Eunknownuser = "unknown user";
 
-static void np_wthread_create(Npsrv *srv);
+static void np_wthread_create(Npsrv *srv, Npreqqueue *q);
 static void np_srv_destroy(Npsrv *srv);
-static void np_wthread_create(Npsrv *srv);
 static void *np_wthread_proc(void *a);
 
 static Npfcall* np_default_version(Npconn *, u32, Npstr *);
@@ -71,18 +71,19 @@ static Npfcall* np_default_read(Npfid *, u64, u32, Npreq *);
 static Npfcall* np_default_write(Npfid *, u64, u32, u8*, Npreq *);
 static Npfcall* np_default_clunk(Npfid *);
 static Npfcall* np_default_remove(Npfid *);
-static Npfcall* np_default_stat(Npfid *);
+static Npfcall* np_default_stat(Npfid *, Npreq *);
 static Npfcall* np_default_wstat(Npfid *, Npstat *);
 
 Npsrv*
 np_srv_create(int nwthread)
 {
     int i;
+    long ncpus;
     Npsrv *srv;
+    Npreqqueue *q;
 
     srv = malloc(sizeof(*srv));
     pthread_mutex_init(&srv->lock, NULL);
-    pthread_cond_init(&srv->reqcond, NULL);
     srv->msize = 8216;
     srv->dotu = 1;
     srv->srvaux = NULL;
@@ -112,14 +113,27 @@ np_srv_create(int nwthread)
     srv->wstat = np_default_wstat;
 
     srv->conns = NULL;
-    srv->reqs_first = NULL;
-    srv->reqs_last = NULL;
-    srv->workreqs = NULL;
     srv->wthreads = NULL;
     srv->debuglevel = 0;
 
+    /* one queue per CPU, but none without a worker of its own */
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > nwthread)
+        ncpus = nwthread;
+    if (ncpus < 1)
+        ncpus = 1;
+
+    srv->nqueues = ncpus;
+    srv->nextqueue = 0;
+    srv->queues = calloc(srv->nqueues, sizeof(Npreqqueue));
+    for(i = 0; i < srv->nqueues; i++) {
+        q = &srv->queues[i];
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->reqcond, NULL);
+    }
+
     for(i = 0; i < nwthread; i++) {
-      np_wthread_create(srv);
+      np_wthread_create(srv, &srv->queues[i % srv->nqueues]);
     }
 
     return srv;
@@ -163,6 +177,7 @@ np_srv_add_conn(Npsrv *srv, Npconn *conn)
   ret = 0;
   pthread_mutex_lock(&srv->lock);
   np_conn_incref(conn);
+  conn->queue = &srv->queues[srv->nextqueue++ % srv->nqueues];
   if (!srv->shuttingdown) {
     conn->srv = srv;
     conn->next = srv->conns;
@@ -212,29 +227,92 @@ np_srv_remove_conn(Npsrv *srv, Npconn *conn)
 static void
 np_srv_destroy(Npsrv *srv)
 {
+    int i;
     Npwthread *wt;
+    Npreqqueue *q;
 
     for(wt = srv->wthreads; wt != NULL; wt = wt->next) {
         wt->shutdown = 1;
     }
-    pthread_cond_broadcast(&srv->reqcond);
+    for(i = 0; i < srv->nqueues; i++) {
+        q = &srv->queues[i];
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->reqcond);
+        pthread_mutex_unlock(&q->lock);
+    }
     (*srv->destroy)(srv);
 }
 
-void
+/* Have an idle worker of some other queue than q look for work, since q's
+ * own are all busy.  Idle workers look at every queue after they say they
+ * are idle, and q has been given its request before this looks at them, so
+ * either this finds one or it finds the request. */
+static void
+np_srv_wake_thief(Npsrv *srv, Npreqqueue *q)
+{
+    int i;
+    Npreqqueue *p;
+
+    __sync_synchronize();
+    for(i = 1; i < srv->nqueues; i++) {
+        p = &srv->queues[(q - srv->queues + i) % srv->nqueues];
+        if (!p->idle)
+            continue;
+
+        pthread_mutex_lock(&p->lock);
+        if (p->idle > p->wakeups) {
+            p->wakeups++;
+            pthread_cond_signal(&p->reqcond);
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* Queue a request of a connection that is not being reset.  Returns 0 if
+ * it is, and the caller drops the request. */
+int
 np_srv_add_req(Npsrv *srv, Npreq *req)
 {
-    req->prev = srv->reqs_last;
-    if (srv->reqs_last)
-        srv->reqs_last->next = req;
-    srv->reqs_last = req;
-    if (!srv->reqs_first)
-        srv->reqs_first = req;
-    pthread_cond_signal(&srv->reqcond);
+    int idle;
+    Npconn *conn;
+    Npreqqueue *q;
+
+    conn = req->conn;
+    q = conn->queue;
+    pthread_mutex_lock(&conn->reqlock);
+    if (conn->resetting) {
+        pthread_mutex_unlock(&conn->reqlock);
+        return 0;
+    }
+    np_conn_add_req(conn, req);
+
+    pthread_mutex_lock(&q->lock);
+    req->queue = q;
+    req->state = Npreqqueued;
+    req->next = NULL;
+    req->prev = q->reqs_last;
+    if (q->reqs_last)
+        q->reqs_last->next = req;
+    q->reqs_last = req;
+    if (!q->reqs_first)
+        q->reqs_first = req;
+
+    idle = q->idle;
+    if (idle)
+        pthread_cond_signal(&q->reqcond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_mutex_unlock(&conn->reqlock);
+
+    if (!idle)
+        np_srv_wake_thief(srv, q);
+
+    return 1;
 }
 
 void
-np_srv_remove_req(Npsrv *srv, Npreq *req)
+np_srv_remove_req(Npreqqueue *q, Npreq *req)
 {
     if (req->prev)
         req->prev->next = req->next;
@@ -242,47 +320,60 @@ np_srv_remove_req(Npsrv *srv, Npreq *req)
     if (req->next)
         req->next->prev = req->prev;
 
-    if (req == srv->reqs_first)
-        srv->reqs_first = req->next;
+    if (req == q->reqs_first)
+        q->reqs_first = req->next;
 
-    if (req == srv->reqs_last)
-        srv->reqs_last = req->prev;
+    if (req == q->reqs_last)
+        q->reqs_last = req->prev;
 }
 
-void
-np_srv_add_workreq(Npsrv *srv, Npreq *req)
+/* Start work on the first request waiting on q, under q's lock */
+static Npreq *
+np_srv_take_req(Npreqqueue *q)
 {
-  static int counter = 0;
+    Npreq *req;
 
-  //  printf("%d np_srv_add_workreq\n",counter++);
-  if (srv->workreqs)
-    srv->workreqs->prev = req;
-  
-  req->next = srv->workreqs;
-  srv->workreqs = req;
-  req->prev = NULL;
+    req = q->reqs_first;
+    if (req) {
+        np_srv_remove_req(q, req);
+        req->state = Npreqworking;
+    }
+
+    return req;
 }
 
-void
-np_srv_remove_workreq(Npsrv *srv, Npreq *req)
+/* Take a request from some queue other than q */
+static Npreq *
+np_srv_steal_req(Npsrv *srv, Npreqqueue *q)
 {
-    if (req->prev)
-        req->prev->next = req->next;
-    else
-        srv->workreqs = req->next;
+    int i;
+    Npreq *req;
+    Npreqqueue *p;
 
-    if (req->next)
-        req->next->prev = req->prev;
+    for(i = 1; i < srv->nqueues; i++) {
+        p = &srv->queues[(q - srv->queues + i) % srv->nqueues];
+        if (!p->reqs_first)
+            continue;
+
+        pthread_mutex_lock(&p->lock);
+        req = np_srv_take_req(p);
+        pthread_mutex_unlock(&p->lock);
+        if (req)
+            return req;
+    }
+
+    return NULL;
 }
 
 static void
-np_wthread_create(Npsrv *srv)
+np_wthread_create(Npsrv *srv, Npreqqueue *q)
 {
     int err;
     Npwthread *wt;
 
     wt = malloc(sizeof(*wt));
     wt->srv = srv;
+    wt->queue = q;
     wt->shutdown = 0;
     err = pthread_create(&wt->thread, NULL, np_wthread_proc, wt);
     if (err) {
@@ -394,56 +485,51 @@ done:
 static Npfcall*
 np_flush(Npreq *req, Npfcall *tc)
 {
-    u16 oldtag;
+    int state;
     Npreq *creq;
     Npconn *conn;
     Npfcall *ret;
+    Npreqqueue *q;
 
-    ret = NULL;
     conn = req->conn;
-    oldtag = tc->oldtag;
-    pthread_mutex_lock(&conn->srv->lock);
-    // check pending requests
-    for(creq = conn->srv->reqs_first; creq != NULL; creq = creq->next) {
-        if (creq->conn==conn && creq->tag==oldtag) {
-            np_srv_remove_req(conn->srv, creq);
-            pthread_mutex_lock(&creq->lock);
-            np_conn_respond(creq); /* doesn't send anything */
-            pthread_mutex_unlock(&creq->lock);
-            np_req_unref(creq);
-            ret = np_create_rflush();
-            creq = NULL;
-            goto done;
-        }
+    creq = np_conn_find_req(conn, tc->oldtag);
+    if (!creq)
+        return np_create_rflush();
+
+    // a pending request is dropped before a worker gets to it
+    q = creq->queue;
+    pthread_mutex_lock(&q->lock);
+    state = creq->state;
+    if (state == Npreqqueued) {
+        np_srv_remove_req(q, creq);
+        creq->state = Npreqdropped;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (state == Npreqqueued) {
+        pthread_mutex_lock(&creq->lock);
+        np_conn_respond(creq); /* doesn't send anything */
+        pthread_mutex_unlock(&creq->lock);
+        np_req_unref(creq);
     }
 
-    // check working requests
-    creq = conn->srv->workreqs;
-    while (creq != NULL) {
-        if (creq->conn==conn && creq->tag==oldtag) {
-            np_req_ref(creq);
-            pthread_mutex_lock(&creq->lock);
+    // a working one answers the flush along with itself
+    ret = NULL;
+    if (state == Npreqworking) {
+        pthread_mutex_lock(&creq->lock);
+        if (!creq->responded) {
             req->flushreq = creq->flushreq;
             creq->flushreq = req;
-            pthread_mutex_unlock(&creq->lock);
-            goto done;
-        }
-        creq = creq->next;
-    }
+        } else
+            ret = np_create_rflush();
+        pthread_mutex_unlock(&creq->lock);
 
-    // if not found, return Rflush
-    if (!creq)
+        if (!ret && conn->srv->flush)
+            (*conn->srv->flush)(creq);
+    } else
         ret = np_create_rflush();
 
-done:
-    pthread_mutex_unlock(&conn->srv->lock);
-
-    // if working request found, try to flush it
-    if (creq && req->conn->srv->flush) {
-        (*req->conn->srv->flush)(creq);
-        np_req_unref(creq);
-    }
-
+    np_req_unref(creq);
     return ret;
 }
 
@@ -747,7 +833,7 @@ np_clunk(Npreq *req, Npfcall *tc)
 
     if (fid->omode!=(u16)~0 && fid->omode==Orclose) {
         rc = (*conn->srv->remove)(fid);
-        if (rc->type == Rerror)
+        if (!rc || rc->type == Rerror)
             goto done;
         free(rc);
         rc = np_create_rclunk();
@@ -803,7 +889,7 @@ np_stat(Npreq *req, Npfcall *tc)
         np_fid_incref(fid);
 
     req->fid = fid;
-    rc = (*conn->srv->stat)(fid);
+    rc = (*conn->srv->stat)(fid, req);
 
 done:
 //  np_fid_decref(fid);
@@ -894,7 +980,7 @@ np_process_request(Npreq *req)
     np_rerror(&ename, &ecode);
     if (ename != NULL) {
         if (rc)
-            free(rc);
+            np_free_fcall(rc);
         rc = np_create_rerror(ename, ecode, conn->dotu);
     }
 
@@ -908,29 +994,47 @@ np_wthread_proc(void *a)
     Npsrv *srv;
     Npreq *req;
     Npfcall *rc;
+    Npreqqueue *q;
 
     wt = a;
     srv = wt->srv;
-    req = NULL;
-
-    pthread_mutex_lock(&srv->lock);
+    q = wt->queue;
     while (!wt->shutdown) {
-        req = srv->reqs_first;
+        pthread_mutex_lock(&q->lock);
+        req = np_srv_take_req(q);
+        pthread_mutex_unlock(&q->lock);
+        if (!req)
+            req = np_srv_steal_req(srv, q);
+
         if (!req) {
-            pthread_cond_wait(&srv->reqcond, &srv->lock);
-            continue;
+            /* say so before the last look around; see np_srv_wake_thief */
+            pthread_mutex_lock(&q->lock);
+            q->idle++;
+            pthread_mutex_unlock(&q->lock);
+            __sync_synchronize();
+            req = np_srv_steal_req(srv, q);
+
+            pthread_mutex_lock(&q->lock);
+            while (!req && !wt->shutdown) {
+                req = np_srv_take_req(q);
+                if (req)
+                    break;
+                if (q->wakeups) {
+                    q->wakeups--;
+                    break;
+                }
+                pthread_cond_wait(&q->reqcond, &q->lock);
+            }
+            q->idle--;
+            pthread_mutex_unlock(&q->lock);
+            if (!req)
+                continue;
         }
 
-        np_srv_remove_req(srv, req);
-        np_srv_add_workreq(srv, req);
-        pthread_mutex_unlock(&srv->lock);
-
         req->wthread = wt;
         rc = np_process_request(req);
         if (rc)
             np_respond(req, rc);
-
-        pthread_mutex_lock(&srv->lock);
     }
 
     return NULL;
@@ -939,13 +1043,11 @@ np_wthread_proc(void *a)
 void
 np_respond(Npreq *req, Npfcall *rc)
 {
-    Npsrv *srv;
     Npreq *freq;
 
-    srv = req->conn->srv;
     pthread_mutex_lock(&req->lock);
     if (req->responded) {
-        free(rc);
+        np_free_fcall(rc);
         pthread_mutex_unlock(&req->lock);
         np_req_unref(req);
         return;
@@ -953,12 +1055,7 @@ np_respond(Npreq *req, Npfcall *rc)
     req->responded = 1;
     pthread_mutex_unlock(&req->lock);
 
-    pthread_mutex_lock(&srv->lock);
-    np_srv_remove_workreq(srv, req);
-    for(freq = req->flushreq; freq != NULL; freq = freq->flushreq)
-        np_srv_remove_workreq(srv, freq);
-    pthread_mutex_unlock(&srv->lock);
-
+    /* a NULL rc drops a flushed request without sending anything */
     pthread_mutex_lock(&req->lock);
     req->rcall = rc;
     if (req->rcall) {
@@ -966,12 +1063,12 @@ np_respond(Npreq *req, Npfcall *rc)
             req->fid->diroffset = req->tcall->offset + req->rcall->count;
 
         np_set_tag(req->rcall, req->tag);
-        if (req->fid != NULL) {
-            np_fid_decref(req->fid);
-            req->fid = NULL;
-        }
-        np_conn_respond(req);
     }
+    if (req->fid != NULL) {
+        np_fid_decref(req->fid);
+        req->fid = NULL;
+    }
+    np_conn_respond(req);
 
     for(freq = req->flushreq; freq != NULL; freq = freq->flushreq) {
         pthread_mutex_lock(&freq->lock);
@@ -985,6 +1082,21 @@ np_respond(Npreq *req, Npfcall *rc)
     np_req_unref(req);
 }
 
+/* Take the incoming message away from the request so that its data can be
+ * kept without copying it.  The caller frees it with free(). */
+Npfcall *
+np_req_adopt_tcall(Npreq *req)
+{
+    Npfcall *tc;
+
+    pthread_mutex_lock(&req->lock);
+    tc = req->tcall;
+    req->tcall = NULL;
+    pthread_mutex_unlock(&req->lock);
+
+    return tc;
+}
+
 void
 np_respond_error(Npreq *req, char *ename, int ecode)
 {
@@ -1092,7 +1204,7 @@ np_default_remove(Npfid *fid)
 }
 
 static Npfcall*
-np_default_stat(Npfid *fid)
+np_default_stat(Npfid *fid, Npreq *req)
 {
     np_werror(Enotimpl, ENOSYS);
     return NULL;
@@ -1132,31 +1244,32 @@ Npreq *np_req_alloc(Npconn *conn, Npfcall *tc) {
     req->next = NULL;
     req->prev = NULL;
     req->wthread = NULL;
+    req->queue = NULL;
+    req->state = Npreqqueued;
+    req->tagnext = NULL;
     req->fid = NULL;
 
     return req;
 }
 
+/* Atomic, so that a request can be referenced under its connection's
+ * reqlock, which np_conn_respond takes with the request's lock held */
 Npreq *
 np_req_ref(Npreq *req)
 {
-    pthread_mutex_lock(&req->lock);
-    req->refcount++;
-    pthread_mutex_unlock(&req->lock);
+    __sync_fetch_and_add(&req->refcount, 1);
     return req;
 }
 
 void
 np_req_unref(Npreq *req)
 {
-    pthread_mutex_lock(&req->lock);
-    assert(req->refcount > 0);
-    req->refcount--;
-    if (req->refcount) {
-        pthread_mutex_unlock(&req->lock);
+    int refs;
+
+    refs = __sync_sub_and_fetch(&req->refcount, 1);
+    assert(refs >= 0);
+    if (refs)
         return;
-    }
-    pthread_mutex_unlock(&req->lock);
 
     if (req->conn)
         np_conn_decref(req->conn);
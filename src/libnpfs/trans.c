@@ -44,6 +44,7 @@ np_trans_create(void *aux, int (*read)(u8 *, u32, void *),
     trans->aux = aux;
     trans->read = read;
     trans->write = write;
+    trans->writev = NULL;
     trans->destroy = destroy;
 
     return trans;
@@ -66,6 +67,26 @@ np_trans_write(Nptrans *trans, u8* data, u32 count)
         return -1;
 }
 
+int
+np_trans_writev(Nptrans *trans, struct iovec *iov, int iovcnt)
+{
+    int i, n, ret;
+
+    if (trans->writev)
+        return trans->writev(iov, iovcnt, trans->aux);
+
+    ret = 0;
+    for(i = 0; i < iovcnt; i++) {
+        n = np_trans_write(trans, iov[i].iov_base, iov[i].iov_len);
+        if (n <= 0)
+            return n;
+
+        ret += n;
+    }
+
+    return ret;
+}
+
 int
 np_trans_read(Nptrans *trans, u8* data, u32 count)
 {
@@ -25,22 +25,25 @@
  */
 #include <config.h>
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <npfs.h>
 
-static int syncfs_read(Npfilefid *fid, u64 offset, u32 count, u8 *data,
-                       Npreq *req);
+static Npfcall *syncfs_readv(Npfilefid *fid, u64 offset, u32 count,
+                             Npreq *req);
 static int syncfs_write(Npfilefid *fid, u64 offset, u32 count, u8 *data,
                         Npreq *req);
 static int syncfs_wstat(Npfile * file, Npstat *stat);
@@ -50,51 +53,456 @@ static Npfile *syncfs_create(Npfile *dir, char *name, u32 perm, Npuser *uid,
 static Npfile *syncfs_first(Npfile *dir);
 static Npfile *syncfs_next(Npfile *dir, Npfile *prevchild);
 static int syncfs_remove(Npfile *dir, Npfile *file);
-static Npfcall *syncfs_stat(Npfid *fid);
+static Npfcall *syncfs_stat(Npfid *fid, Npreq *req);
+static void syncfs_flush(Npreq *req);
+static void syncfs_closefid(Npfilefid *fid);
+static int syncfs_open(Npfilefid *fid);
+static Npfcall *changes_readv(Npfilefid *fid, u64 offset, u32 count,
+                              Npreq *req);
+static int changes_open(Npfilefid *fid);
+static void changes_close(Npfilefid *fid);
+static int participant_write(Npfilefid *fid, u64 offset, u32 count, u8 *data,
+                             Npreq *req);
+static int participant_open(Npfilefid *fid);
+static void participant_close(Npfilefid *fid);
+static int participant_wstat(Npfile *file, Npstat *stat);
+static Npfcall *snapshot_readv(Npfilefid *fid, u64 offset, u32 count,
+                               Npreq *req);
+static int snapshot_open(Npfilefid *fid);
+static Npfcall *batch_readv(Npfilefid *fid, u64 offset, u32 count,
+                            Npreq *req);
+static int batch_write(Npfilefid *fid, u64 offset, u32 count, u8 *data,
+                       Npreq *req);
+
+/* File data is kept in chunks of up to blksize bytes that are shared between
+ * revisions, so a revision is cloned by copying chunk pointers and a chunk is
+ * copied only when a revision that shares it is modified.  A NULL chunk, and
+ * anything past the end of a chunk smaller than blksize, reads as zeros, and
+ * the bytes of a chunk past the end of the file are always zero.  A file of
+ * up to FILEREV_INLINE bytes has no chunks and lives in the revision. */
+#define FILEREV_INLINE 64
+
+typedef struct FileBuf FileBuf;
+
+struct FileChunk {
+    u64 refs;
+    u8 *data;
+    u32 size;           /* bytes at data, less than blksize only at the end */
+    FileBuf *buf;       /* adopted message the data lives in, or NULL */
+};
+typedef struct FileChunk FileChunk;
+
+/* A Twrite message whose whole chunks were taken over as file data instead
+ * of being copied out.  It is freed when the last of its chunks is. */
+struct FileBuf {
+    u64 refs;
+    Npfcall *fc;
+    FileChunk chunks[];
+};
 
 struct FileRev {
     u64 refs;
     u64 length;
-    u64 datasize;
-    u8 *data;
+    u64 nchunks;
+    FileChunk **chunks;
+    u8 data[FILEREV_INLINE];    /* the file when there are no chunks */
+    u64 base;                   /* offset of the first byte, for a log */
+    u64 tick;                   /* committed by */
+    struct FileRev *prev;       /* the revision this one replaced */
+    struct FileRev *next;       /* on the retired list */
+    u64 epoch;                  /* retired in */
 };
 typedef struct FileRev FileRev;
 
-struct File {
+/* Chunks and revisions come from size classes carved out of SLAB_SIZE slabs
+ * instead of malloc, so a small file costs a small object rather than a
+ * page.  Freed objects go back on the free list of their class; slabs are
+ * never given back. */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MINCHUNK 128
+#define SLAB_MAXCLASSES 32
+
+struct Slab {
     pthread_mutex_t lock;
+    u32 size;           /* object size */
+    u32 datasize;       /* chunk data per object, for chunk classes */
+    void *free;
+    u64 inuse;
+    u64 total;
+};
+typedef struct Slab Slab;
+
+/* Requests parked until a tick.  A flushed request leaves a NULL behind so
+ * that the indices stay valid. */
+struct ReqList {
+    Npreq **reqs;
+    int count;
+    int size;
+};
+typedef struct ReqList ReqList;
+
+/* A log file keeps everything written to it, in the order it came, and
+ * offsets into it stay put as it is trimmed from the front.  Trimming goes
+ * by whole chunks, and happens as the log is written to, once it holds
+ * more than bytes or what was written more than ticks ago; 0 is no limit.
+ * Reads below base, the offset of the first byte kept, fail. */
+struct LogMark {
+    u64 tick;           /* that the writes from here on commit in */
+    u64 offset;
+};
+typedef struct LogMark LogMark;
+
+struct LogLimits {
+    u64 bytes;
+    u64 ticks;
+    LogMark *marks;     /* oldest first, only kept with a ticks limit */
+    int nmarks;
+    int size;
+};
+typedef struct LogLimits LogLimits;
+
+struct File {
     pthread_mutex_t wlock;
-    FileRev *fr_read;
+    FileRev *fr_read;   /* read without locks, see Reader */
     FileRev *fr_write;
+    struct Domain *dom; /* commits the file, or for a directory its children */
+    u64 queuedtick;     /* tick whose commit set holds this file */
+    ReqList watchers;   /* reads waiting for a commit, under wlock */
+    int kind;           /* how writes combine */
+    u64 acc;            /* what a tick's have come to so far, under wlock */
+    int accum;          /* fr_write has this tick's writes in it, which an
+                         * OTRUNC or wstat making fr_write does not count */
+    LogLimits log;      /* what a log keeps, under wlock */
 };
 typedef struct File File;
 
+/* A data file created with one of these names as its 9P2000.u extension
+ * combines all the writes it gets in a tick into what that tick commits,
+ * instead of keeping whatever the last writer left.  Each write to a number
+ * file is one integer in decimal, or hex or octal with a C prefix, and the
+ * file reads as the result in decimal.  Writes to an append file are
+ * joined in the order they came.  The first write of a tick starts afresh
+ * and offsets are ignored.  The extension log, optionally followed by
+ * bytes=n and ticks=n, makes a log file instead.
+ *
+ * The extension queue, with the same options, makes a log whose writes are
+ * each a message.  A fid opened on a queue has a cursor starting at the end
+ * of what is committed, and each read gives the next message after it, or
+ * as much of the message as fits with the rest coming in the following
+ * reads.  A read with nothing left waits for the next tick that brings any.
+ * A queue keeps QUEUE_TICKS ticks of messages unless told otherwise; a
+ * reader that falls further behind than that gets an error once and goes on
+ * from the oldest tick still whole. */
+#define QUEUE_TICKS 64
+
+enum {
+    Rnone,
+    Rsum,
+    Rmin,
+    Rmax,
+    Ror,
+    Rappend,
+    Rlog,
+    Rqueue,
+};
+
+static char *kindnames[] = {
+    [Rsum] = "sum",
+    [Rmin] = "min",
+    [Rmax] = "max",
+    [Ror] = "or",
+    [Rappend] = "append",
+    [Rlog] = "log",
+    [Rqueue] = "queue",
+};
+
+/* Opening a file with this mode bit, which otherwise means nothing to a
+ * server, makes a read at offset 0 wait until there is a revision of the
+ * file newer than the last one read through the fid.  Reads at other
+ * offsets come from that same revision, so a big file still reads whole. */
+#define Owatch Orexec
+
+/* Walking to name@tick instead of name gives a fid that reads the file as it
+ * was committed at that tick, for as long as the file's history goes back
+ * that far.  Such a fid cannot be written. */
+
+/* Walking to .snapshot in a directory that has no file by that name gives a
+ * fid that, once opened, reads an archive of every data file below the
+ * directory as it was when one tick came out.  The archive is tick[8]
+ * followed by name[s] length[8] data[length] for each file, where name is
+ * the path from the directory, all in 9P byte order.  The files are those
+ * there when the fid is opened.  Below a directory with a clock of its own
+ * the tick is that of its domain at the time. */
+struct SnapEntry {
+    FileRev *fr;        /* NULL for the tick at the start */
+    u64 start;          /* of the record in the archive */
+    u32 hdroff;         /* of the record's name and length in hdr */
+    u32 hdrlen;
+};
+typedef struct SnapEntry SnapEntry;
+
+struct Snapshot {
+    u64 refs;           /* the fid's and one for each reply being sent */
+    u64 length;
+    SnapEntry *entries;
+    int count;
+    int size;
+    u8 *hdr;
+    u32 hdrlen;
+    u32 hdrsize;
+};
+typedef struct Snapshot Snapshot;
+
+/* Likewise .batch takes writes of any number of records
+ * name[s] count[4] data[count], where name is the path of a data file from
+ * the directory, and makes each file's next revision hold just its data.
+ * The records of one write all commit in the same tick.  A record that
+ * cannot be applied is skipped, and a read of the fid then gives a line
+ * "record error" for each one skipped by the last write, counting records
+ * from 0.  A write that does not parse is refused whole. */
+
+/* What a fid of a data file, .snapshot or .batch keeps in its aux,
+ * allocated on first use */
+struct FileFid {
+    FileRev *seen;      /* last read through an Owatch fid */
+    u64 tick;           /* from a name@tick walk, or 0 */
+    Npfile *dir;        /* that a .snapshot or .batch was walked to from */
+    Snapshot *snap;     /* read through an open .snapshot */
+    char *errors;       /* of the last .batch write, under the fid's lock */
+    int errorslen;
+    u64 cursor;         /* of the next byte to read from a queue */
+    u32 left;           /* of the message at cursor, 0 at its header */
+};
+typedef struct FileFid FileFid;
+
 static Npsrv *srv;
 static Npfile *root;
-static Npfile *clkfile;
+static Npfile *statsfile;
+static Npfile *snapfile;    /* what every .snapshot fid is open on */
+static Npfile *batchfile;   /* and every .batch fid */
 static u64 qidpath;
 static int blksize;
-static long int clkperiod;
-
-struct NpfileList {
-    Npfile *file;
-    struct NpfileList *next;
+static long int clkperiod;  /* of the root domain */
+static int histdepth;       /* committed revisions kept per file, besides the
+                             * current one */
+static int nrthreads;
+
+/* Kept by the tick thread, in ns */
+struct TickStats {
+    u64 count;
+    u64 overruns;       /* ticks that ran past the next deadline */
+    u64 skipped;        /* deadlines dropped because of an overrun */
+    u64 lastjitter;     /* how late the last tick started */
+    u64 maxjitter;
+    u64 sumjitter;
+    u64 early;          /* fired by the participants */
+    u64 timeouts;       /* waited out the period with participants */
+    u64 commitfiles;    /* files in the last commit */
+    u64 lastcommit;     /* how long the last commit took */
+    u64 maxcommit;
+};
+typedef struct TickStats TickStats;
+
+static long int tickspin;
+static int tickcatchup;     /* run missed ticks back to back, not skip them */
+
+/* Files written during a tick are queued on the current commit set.  The
+ * tick thread swaps in the other set and commits the old one without holding
+ * the commits lock, so writers only ever wait for an append. */
+struct FileCommits {
+    Npfile **files;
+    int count;
+    int size;
+};
+typedef struct FileCommits FileCommits;
+
+/* A commit set big enough to be worth it is split into contiguous slices,
+ * one per commit worker with the tick thread taking the first, and the tick
+ * goes on only once every slice is done. */
+#define COMMIT_MINSLICE 256
+
+struct CommitWorker {
+    struct Domain *dom;
+    struct CommitWorker *next;  /* on the commit queue */
+    FileCommits *fc;
+    int start;
+    int end;
+    u64 tick;
+    time_t now;
+    FileRev *retired;   /* revisions replaced in this slice */
+    ReqList woken;      /* watchers of the files committed in this slice */
+    int changes;        /* list what is committed for the changes file */
+    char *text;
+    int textlen;
+    int textsize;
+    int nchanged;
+    int textlost;       /* ran out of memory for the list */
 };
-typedef struct NpfileList NpfileList;
+typedef struct CommitWorker CommitWorker;
 
-static NpfileList *filecommits = NULL;
-static pthread_mutex_t filecommits_lock = PTHREAD_MUTEX_INITIALIZER;
+#define RELEASE_BATCH 16
 
-struct LockList {
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    struct LockList *next;
+/* The files one tick committed, as the changes file shows them: a line with
+ * the tick and the number of files, then a line with the qid path and name
+ * of each.  NULL text means the tick was not listed, or if lost is set that
+ * its list was dropped for want of memory. */
+#define CHANGES_HISTORY 64
+
+struct Changes {
+    u64 tick;
+    char *text;
+    int len;
+    int lost;
+};
+typedef struct Changes Changes;
+
+/* Where a fid is in the changes file.  A read at offset N lists tick N,
+ * waiting for it if it is still to come, and reads at the same offset carry
+ * on through the list until it is used up.  Offset 0 follows on from the
+ * last tick read, starting with the next one. */
+struct ChangesCursor {
+    u64 tick;
+    int pos;
+};
+typedef struct ChangesCursor ChangesCursor;
+
+/* A clock domain is a directory with a clock file of its own.  Everything
+ * created under it is committed by its tick thread at its own period, with
+ * its own commit set and waiters, so a fast domain never waits on the commits
+ * of a slow one.  The commit workers and release threads are one pool shared
+ * by every domain, leaving a domain a thread of its own only for the tick.
+ * Nested directories belong to the domain of their parent until they get a
+ * clock. */
+struct Domain {
+    Npfile *dir;
+    Npfile *clkfile;
+    Npfile *partfile;
+    Npfile *changesfile;
+    long int period;            /* ns */
+    struct Domain *next;
+
+    /* Each fid open on the participants file is a participant, which
+     * arrives by writing to it.  The tick fires as soon as every
+     * participant has arrived, the period only acting as a timeout. */
+    int nparticipants;
+    int narrived;
+    u64 barriergen;
+    pthread_mutex_t barrier_lock;
+    pthread_cond_t barrier_cond;
+
+    FileCommits commits[2];
+    FileCommits *commits_cur;
+    u64 commits_tick;
+    pthread_mutex_t commits_lock;
+
+    /* Held by a commit from before it takes the commit set until every
+     * file in it is installed, and by a batch while it writes, so that a
+     * batch lands in one tick whole */
+    pthread_mutex_t batch_lock;
+
+    /* The last tick whose commit is complete.  Revisions are installed
+     * tagged with the tick committing them, and a reader that finds one
+     * newer than the tick it started in steps back to the one it replaced,
+     * so a whole tick becomes visible at once when this is advanced. */
+    u64 committed_tick;
+
+    int running;                /* the tick thread may start */
+    CommitWorker *workers;      /* a slice each */
+    int commitpending;          /* slices still on the commit queue */
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_done_cond;
+
+    /* A Tstat of the clock file, or a watching read of a file the tick
+     * commits, is parked here instead of blocking a worker thread.
+     * Releasing a tick only moves waiters_released up to the end of the
+     * list and puts the domain on the release queue; the release threads
+     * then claim the parked requests in batches and answer them. */
+    ReqList waiters;
+    int waiters_next;           /* first waiter not yet claimed */
+    int waiters_released;       /* waiters before this have ticked */
+    int releasing;              /* on the release queue */
+    struct Domain *releasenext;
+    pthread_mutex_t waiters_lock;
+
+    FileRev *retiring;          /* retired this tick, tick thread only */
+    TickStats stats;
+
+    /* Only kept while someone has the changes file open */
+    Changes changes[CHANGES_HISTORY];
+    u64 changes_tick;           /* the last tick listed */
+    int changes_open;
+    pthread_mutex_t changes_lock;
 };
-typedef struct LockList LockList;
+typedef struct Domain Domain;
 
-static LockList *clockstaters = NULL;
-static pthread_mutex_t clockstaters_lock = PTHREAD_MUTEX_INITIALIZER;
+struct Participant {
+    u64 gen;            /* barrier generation it last arrived in */
+};
+typedef struct Participant Participant;
+
+static Domain *rootdom;
+static Domain *domains;
+static pthread_mutex_t domains_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ncommitworkers;
+
+/* Slices of every domain's commits wait here for the commit workers */
+static CommitWorker *commitq_first;
+static CommitWorker *commitq_last;
+static pthread_mutex_t commitq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commitq_cond = PTHREAD_COND_INITIALIZER;
+
+/* Domains with released waiters wait here for the release threads */
+static Domain *releaseq_first;
+static Domain *releaseq_last;
+static pthread_mutex_t releaseq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t releaseq_cond = PTHREAD_COND_INITIALIZER;
+
+static int domain_start(Domain *d);
+static void domain_run(Domain *d);
+
+/* Readers find the committed revision of a file without taking a lock.  A
+ * thread publishes the epoch it is reading in for the length of the read.
+ * Revisions replaced by a tick are retired with the epoch current when the
+ * tick came out, the epoch is advanced, and a retired revision is freed once no reader is left
+ * in an epoch at or before the one it was retired in.  The freeing is done
+ * by a reclaimer thread so that the tick does not pay for it. */
+struct Reader {
+    u64 epoch;          /* 0 when not reading */
+    int active;         /* owned by a live thread */
+    struct Reader *next;
+};
+typedef struct Reader Reader;
+
+static u64 read_epoch = 1;
+static Reader *readers;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+/* handed from the tick threads to the reclaimer, newest first */
+static FileRev *retired;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retired_cond = PTHREAD_COND_INITIALIZER;
+
+/* what a hole is sent from */
+static u8 *zerochunk;
+
+static Slab chunkslabs[SLAB_MAXCLASSES];
+static int nchunkslabs;
+static Slab revslab;
 
 static char *Enospace = "no space left";
+static char *Ebadperiod = "bad clock period";
+static char *Echangeslost = "tick not in changes history";
+static char *Enohistory = "tick not in file history";
+static char *Etickahead = "tick not committed yet";
+static char *Etoolong = "path too long";
+static char *Ebadbatch = "bad batch record";
+static char *Eotherdomain = "file in another clock domain";
+static char *Ebadvalue = "bad value";
+static char *Ebadtype = "unknown file type";
+static char *Etrimmed = "offset trimmed from log";
+static char *Equeuelost = "messages dropped from queue";
 
 static Npdirops dirops = {
     .create = syncfs_create,
@@ -106,10 +514,39 @@ static Npdirops dirops = {
 };
 
 static Npfileops fileops = {
-    .read = syncfs_read,
+    .readv = syncfs_readv,
     .write = syncfs_write,
     .wstat = syncfs_wstat,
     .destroy = syncfs_destroy,
+    .openfid = syncfs_open,
+    .closefid = syncfs_closefid,
+};
+
+static Npfileops changesops = {
+    .readv = changes_readv,
+    .openfid = changes_open,
+    .closefid = changes_close,
+    .destroy = syncfs_destroy,
+};
+
+static Npfileops snapshotops = {
+    .readv = snapshot_readv,
+    .openfid = snapshot_open,
+    .closefid = syncfs_closefid,
+};
+
+static Npfileops batchops = {
+    .readv = batch_readv,
+    .write = batch_write,
+    .closefid = syncfs_closefid,
+};
+
+static Npfileops participantops = {
+    .write = participant_write,
+    .openfid = participant_open,
+    .closefid = participant_close,
+    .wstat = participant_wstat,
+    .destroy = syncfs_destroy,
 };
 
 Npstr *npstr_of_str(char *str) {
@@ -124,518 +561,3280 @@ Npstr *npstr_of_str(char *str) {
     return nps;
 }
 
-static void filecommits_add(Npfile *f) {
-    NpfileList *first;
+static int filecommits_push(FileCommits *fc, Npfile *file) {
+    int size;
+    Npfile **files;
 
-    first = malloc(sizeof(NpfileList));
+    if(fc->count == fc->size) {
+        size = fc->size ? fc->size * 2 : 64;
+        files = realloc(fc->files, size * sizeof(Npfile *));
+        if(!files)
+            return -1;
+
+        fc->files = files;
+        fc->size = size;
+    }
 
-    pthread_mutex_lock(&filecommits_lock);
-    first->file = f;
-    first->next = filecommits;
-    filecommits = first;
-    pthread_mutex_unlock(&filecommits_lock);
+    fc->files[fc->count++] = file;
+    return 0;
 }
 
-static Npfile *filecommits_pop(void) {
-    Npfile *f;
-    NpfileList *next;
+/* Queue a file for the next commit of its domain.  A file is queued at most
+ * once per tick, and the commit set holds a reference on it until the commit
+ * is done.  The caller says whether it already holds file->lock. */
+static int filecommits_add(Npfile *file, int locked) {
+    int ret;
+    File *f;
+    Domain *d;
 
-    if(filecommits == NULL)
-        return NULL;
+    f = file->aux;
+    d = f->dom;
+    pthread_mutex_lock(&d->commits_lock);
+    if(f->queuedtick == d->commits_tick) {
+        pthread_mutex_unlock(&d->commits_lock);
+        return 0;
+    }
+
+    if(locked)
+        file->refcount++;
+    else {
+        pthread_mutex_unlock(&d->commits_lock);
+        npfile_incref(file);
+        pthread_mutex_lock(&d->commits_lock);
+        if(f->queuedtick == d->commits_tick) {
+            pthread_mutex_unlock(&d->commits_lock);
+            npfile_decref(file);
+            return 0;
+        }
+    }
 
-    f = filecommits->file;
-    next = filecommits->next;
-    free(filecommits);
-    filecommits = next;
+    ret = filecommits_push(d->commits_cur, file);
+    if(!ret)
+        f->queuedtick = d->commits_tick;
+    pthread_mutex_unlock(&d->commits_lock);
 
-    return f;
+    if(ret) {
+        if(locked)
+            file->refcount--;
+        else
+            npfile_decref(file);
+    }
+
+    return ret;
+}
+
+static int reqlist_push(ReqList *rl, Npreq *req) {
+    int size;
+    Npreq **reqs;
+
+    if(rl->count == rl->size) {
+        size = rl->size ? rl->size * 2 : 64;
+        reqs = realloc(rl->reqs, size * sizeof(Npreq *));
+        if(!reqs)
+            return -1;
+
+        rl->reqs = reqs;
+        rl->size = size;
+    }
+
+    rl->reqs[rl->count++] = req;
+    return 0;
+}
+
+static int reqlist_clear(ReqList *rl, int start, Npreq *req) {
+    int i;
+
+    for(i = start; i < rl->count; i++)
+        if(rl->reqs[i] == req) {
+            rl->reqs[i] = NULL;
+            return 1;
+        }
+
+    return 0;
+}
+
+/* Move what is in from to the end of to, leaving behind what did not fit */
+static void reqlist_move(ReqList *to, ReqList *from) {
+    int i, n;
+
+    n = 0;
+    for(i = 0; i < from->count; i++)
+        if(from->reqs[i] && reqlist_push(to, from->reqs[i]))
+            from->reqs[n++] = from->reqs[i];
+    from->count = n;
+}
+
+static void slab_init(Slab *s, u32 size, u32 datasize) {
+    pthread_mutex_init(&s->lock, NULL);
+    s->size = (size + 7) & ~7;
+    s->datasize = datasize;
+    s->free = NULL;
+    s->inuse = 0;
+    s->total = 0;
+}
+
+static void *slab_alloc(Slab *s) {
+    int i, n;
+    u8 *mem;
+    void *p;
+
+    pthread_mutex_lock(&s->lock);
+    if(!s->free) {
+        n = SLAB_SIZE / s->size;
+        if(n < 1)
+            n = 1;
+
+        mem = malloc(n * s->size);
+        if(!mem) {
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+
+        for(i = n - 1; i >= 0; i--) {
+            *(void **) (mem + i * s->size) = s->free;
+            s->free = mem + i * s->size;
+        }
+        s->total += n;
+    }
+
+    p = s->free;
+    s->free = *(void **) p;
+    s->inuse++;
+    pthread_mutex_unlock(&s->lock);
+
+    return p;
+}
+
+static void slab_free(Slab *s, void *p) {
+    pthread_mutex_lock(&s->lock);
+    *(void **) p = s->free;
+    s->free = p;
+    s->inuse--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* One chunk class per power of two from SLAB_MINCHUNK, then blksize */
+static void slab_setup(void) {
+    u32 size;
+
+    slab_init(&revslab, sizeof(FileRev), 0);
+    for(size = SLAB_MINCHUNK; size < blksize; size *= 2)
+        slab_init(&chunkslabs[nchunkslabs++], sizeof(FileChunk) + size, size);
+    slab_init(&chunkslabs[nchunkslabs++], sizeof(FileChunk) + blksize,
+              blksize);
+}
+
+static int slab_stats(char *buf, int len) {
+    int i, n;
+    Slab *s;
+
+    n = snprintf(buf, len, "\"chunks\":[");
+    for(i = 0; i < nchunkslabs && n < len; i++) {
+        s = &chunkslabs[i];
+        pthread_mutex_lock(&s->lock);
+        n += snprintf(buf + n, len - n,
+                      "%s{\"size\":%u,\"inuse\":%llu,\"total\":%llu}",
+                      i ? "," : "", s->datasize,
+                      (unsigned long long) s->inuse,
+                      (unsigned long long) s->total);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if(n < len) {
+        pthread_mutex_lock(&revslab.lock);
+        n += snprintf(buf + n, len - n,
+                      "],\"revs\":{\"inuse\":%llu,\"total\":%llu}",
+                      (unsigned long long) revslab.inuse,
+                      (unsigned long long) revslab.total);
+        pthread_mutex_unlock(&revslab.lock);
+    }
+
+    return n < len ? n : len - 1;
+}
+
+static Slab *filechunk_slab(u32 size) {
+    int i;
+
+    for(i = 0; i < nchunkslabs - 1; i++)
+        if(chunkslabs[i].datasize >= size)
+            break;
+
+    return &chunkslabs[i];
+}
+
+/* A chunk with room for at least size bytes */
+static FileChunk *filechunk_alloc(u32 size) {
+    Slab *s;
+    FileChunk *c;
+
+    s = filechunk_slab(size);
+    c = slab_alloc(s);
+    if(c) {
+        c->refs = 1;
+        c->data = (u8 *) (c + 1);
+        c->size = s->datasize;
+        c->buf = NULL;
+    }
+
+    return c;
+}
+
+/* Chunks are shared by revisions that are protected by different locks */
+static inline void filechunk_ref(FileChunk *c) {
+    __sync_fetch_and_add(&c->refs, 1);
+}
+
+static inline void filechunk_unref(FileChunk *c) {
+    FileBuf *b;
+
+    if(c && __sync_sub_and_fetch(&c->refs, 1) == 0) {
+        b = c->buf;
+        if(!b)
+            slab_free(filechunk_slab(c->size), c);
+        else if(__sync_sub_and_fetch(&b->refs, 1) == 0) {
+            free(b->fc);
+            free(b);
+        }
+    }
+}
+
+static inline u64 filerev_nchunks(u64 length) {
+    return length / blksize + (length % blksize ? 1 : 0);
 }
 
 static FileRev *filerev_alloc(void) {
     FileRev *fr;
 
-    fr = malloc(sizeof(FileRev));
+    fr = slab_alloc(&revslab);
+    if(!fr)
+        return NULL;
+
     fr->refs = 1;
     fr->length = 0;
-    fr->datasize = 0;
-    fr->data = NULL;
+    fr->nchunks = 0;
+    fr->chunks = NULL;
+    fr->base = 0;
+    fr->tick = 0;
+    fr->prev = NULL;
+    memset(fr->data, 0, FILEREV_INLINE);
 
     return fr;
 }
 
+static FileRev *filerev_clone(FileRev *fr) {
+    u64 i;
+    FileRev *nfr;
+
+    nfr = filerev_alloc();
+    if(!nfr)
+        return NULL;
+
+    if(fr->nchunks) {
+        nfr->chunks = malloc(fr->nchunks * sizeof(FileChunk *));
+        if(!nfr->chunks) {
+            slab_free(&revslab, nfr);
+            return NULL;
+        }
+
+        for(i = 0; i < fr->nchunks; i++) {
+            nfr->chunks[i] = fr->chunks[i];
+            if(nfr->chunks[i])
+                filechunk_ref(nfr->chunks[i]);
+        }
+    } else
+        memcpy(nfr->data, fr->data, FILEREV_INLINE);
+
+    nfr->length = fr->length;
+    nfr->nchunks = fr->nchunks;
+    nfr->base = fr->base;
+
+    return nfr;
+}
+
 static inline void filerev_ref(FileRev *fr) {
-    fr->refs++;
+    __sync_fetch_and_add(&fr->refs, 1);
 }
 
 static inline FileRev *filerev_unref(FileRev *fr) {
-    fr->refs--;
-    if(fr->refs <= 0) {
-        if(fr->data)
-            free(fr->data);
-        free(fr);
+    u64 i;
+
+    if(__sync_sub_and_fetch(&fr->refs, 1) == 0) {
+        for(i = 0; i < fr->nchunks; i++)
+            filechunk_unref(fr->chunks[i]);
+        free(fr->chunks);
+        slab_free(&revslab, fr);
         return NULL;
     }
     return fr;
 }
 
-static int filerev_truncate(FileRev *fr, u64 size) {
-    int n;
-    u8 *buf;
+/* Return chunk i ready to be modified with room for size bytes, copying it
+ * if it is shared or too small */
+static u8 *filerev_chunk(FileRev *fr, u64 i, u32 size) {
+    FileChunk *c, *old;
 
-    if(fr->datasize >= size)
-        return 0;
+    old = fr->chunks[i];
+    if(old && old->refs == 1 && old->size >= size)
+        return old->data;
 
-    n = (size / blksize + (size % blksize ? 1 : 0)) * blksize;
-    buf = realloc(fr->data, n);
-    if(!buf)
-        return -1;
+    if(old && old->size > size)
+        size = old->size;
 
-    fr->datasize = n;
-    fr->data = buf;
-    return 0;
+    c = filechunk_alloc(size);
+    if(!c)
+        return NULL;
+
+    if(old) {
+        memcpy(c->data, old->data, old->size);
+        memset(c->data + old->size, 0, c->size - old->size);
+        filechunk_unref(old);
+    } else
+        memset(c->data, 0, c->size);
+
+    fr->chunks[i] = c;
+    return c->data;
 }
 
-static File *file_alloc(void) {
-    File *f;
+static int filerev_resize(FileRev *fr, u64 nchunks) {
+    u64 i;
+    FileChunk *c;
+    FileChunk **chunks;
 
-    f = malloc(sizeof(File));
+    if(nchunks > SIZE_MAX / sizeof(FileChunk *))
+        return -1;
 
-    pthread_mutex_init(&f->lock, NULL);
-    pthread_mutex_init(&f->wlock, NULL);
+    if(nchunks > fr->nchunks) {
+        c = NULL;
+        if(fr->nchunks == 0 && fr->length) {
+            /* the inline data moves to the first chunk */
+            c = filechunk_alloc(fr->length);
+            if(!c)
+                return -1;
+            memcpy(c->data, fr->data, fr->length);
+            memset(c->data + fr->length, 0, c->size - fr->length);
+        }
 
-    f->fr_read = filerev_alloc();
-    f->fr_write = NULL;
+        chunks = realloc(fr->chunks, nchunks * sizeof(FileChunk *));
+        if(!chunks) {
+            filechunk_unref(c);
+            return -1;
+        }
 
-    return f;
+        for(i = fr->nchunks; i < nchunks; i++)
+            chunks[i] = NULL;
+        if(c)
+            chunks[0] = c;
+    } else {
+        for(i = nchunks; i < fr->nchunks; i++)
+            filechunk_unref(fr->chunks[i]);
+
+        if(nchunks == 0) {
+            free(fr->chunks);
+            chunks = NULL;
+            memset(fr->data, 0, FILEREV_INLINE);
+        } else {
+            /* keep the old array if it cannot be shrunk */
+            chunks = realloc(fr->chunks, nchunks * sizeof(FileChunk *));
+            if(!chunks)
+                chunks = fr->chunks;
+        }
+    }
+
+    fr->chunks = chunks;
+    fr->nchunks = nchunks;
+    return 0;
 }
 
-static FileRev *file_readcopy(File *f) {
-    pthread_mutex_lock(&f->lock);
-    FileRev *fr = f->fr_read;
-    filerev_ref(fr);
-    pthread_mutex_unlock(&f->lock);
+static int filerev_truncate(FileRev *fr, u64 size) {
+    u64 n, i;
+    u32 off;
+    u8 *data, buf[FILEREV_INLINE];
+    FileChunk *c;
+
+    if(size <= FILEREV_INLINE) {
+        /* small enough to go back to living in the revision */
+        if(fr->nchunks) {
+            memset(buf, 0, FILEREV_INLINE);
+            c = fr->chunks[0];
+            if(c)
+                memcpy(buf, c->data, size < c->size ? size : c->size);
+
+            filerev_resize(fr, 0);
+            memcpy(fr->data, buf, size);
+        } else if(size < fr->length)
+            memset(fr->data + size, 0, fr->length - size);
+
+        fr->length = size;
+        return 0;
+    }
 
-    FileRev *frw = filerev_alloc();
-    frw->length = fr->length;
-    filerev_truncate(frw, fr->length);
-    memcpy(frw->data, fr->data, fr->length);
+    /* keep the tail of the new last chunk zeroed */
+    off = size % blksize;
+    if(size < fr->length && off) {
+        i = size / blksize;
+        c = fr->chunks[i];
+        if(c && off < c->size) {
+            data = filerev_chunk(fr, i, 0);
+            if(!data)
+                return -1;
+            memset(data + off, 0, fr->chunks[i]->size - off);
+        }
+    }
 
-    pthread_mutex_lock(&f->lock);
-    filerev_unref(fr);
-    pthread_mutex_unlock(&f->lock);
+    n = filerev_nchunks(size);
+    if(n != fr->nchunks && filerev_resize(fr, n))
+        return -1;
 
-    return frw;
+    fr->length = size;
+    return 0;
 }
 
-static void syncfs_connclose(Npconn *conn) {
-    /* Do nothing */
+/* Returns the number of bytes written, which is only short if we ran out of
+ * memory part way through */
+static u32 filerev_write(FileRev *fr, u64 offset, u32 count, u8 *data) {
+    u64 pos, end;
+    u32 n;
+    u8 *buf;
+
+    end = offset + count;
+    if(end < offset)
+        return 0;
+
+    if(fr->nchunks == 0 && end <= FILEREV_INLINE) {
+        memcpy(fr->data + offset, data, count);
+        if(end > fr->length)
+            fr->length = end;
+        return count;
+    }
+
+    if(filerev_nchunks(end) > fr->nchunks &&
+       filerev_resize(fr, filerev_nchunks(end)))
+        return 0;
+
+    for(pos = offset; pos < end; pos += n) {
+        n = blksize - pos % blksize;
+        if(n > end - pos)
+            n = end - pos;
+
+        buf = filerev_chunk(fr, pos / blksize, pos % blksize + n);
+        if(!buf)
+            break;
+
+        memcpy(buf + pos % blksize, data + (pos - offset), n);
+        if(pos + n > fr->length)
+            fr->length = pos + n;
+    }
+
+    return pos - offset;
 }
 
-static int syncfs_read(Npfilefid *fid, u64 offset, u32 count, u8 *data,
-                       Npreq *req) {
-    int n;
-    Npfile *file;
-    File *f;
+/* Store the whole chunks of a chunk aligned write in the request's own
+ * message rather than copying them.  Returns the number of bytes stored,
+ * which is 0 if the write is not worth adopting. */
+static u32 filerev_adopt(FileRev *fr, u64 offset, u32 count, u8 *data,
+                         Npreq *req) {
+    u64 i, n, first;
+    FileBuf *b;
+    FileChunk *c;
+
+    n = count / blksize;
+    first = offset / blksize;
+    if(offset % blksize || n == 0 || offset + count < offset)
+        return 0;
 
-    file = fid->file;
-    f = file->aux;
-    n = count;
+    /* data has to be the payload of the incoming Twrite */
+    if(!req || !req->tcall || req->tcall->data != data)
+        return 0;
 
-    pthread_mutex_lock(&f->lock);
-    FileRev *fr = f->fr_read;
-    filerev_ref(fr);
-    pthread_mutex_unlock(&f->lock);
+    if(first + n > fr->nchunks && filerev_resize(fr, first + n))
+        return 0;
 
-    if(fr->length < offset + count)
-        n = fr->length - offset;
+    b = malloc(sizeof(FileBuf) + n * sizeof(FileChunk));
+    if(!b)
+        return 0;
 
-    if(n < 0)
-        n = 0;
-    memmove(data, fr->data + offset, n);
+    b->refs = n;
+    b->fc = np_req_adopt_tcall(req);
+    for(i = 0; i < n; i++) {
+        c = &b->chunks[i];
+        c->refs = 1;
+        c->data = data + i * blksize;
+        c->size = blksize;
+        c->buf = b;
+
+        filechunk_unref(fr->chunks[first + i]);
+        fr->chunks[first + i] = c;
+    }
 
-    pthread_mutex_lock(&f->lock);
-    filerev_unref(fr);
-    pthread_mutex_unlock(&f->lock);
+    if(offset + n * blksize > fr->length)
+        fr->length = offset + n * blksize;
 
-    return n;
+    return n * blksize;
 }
 
-static int syncfs_write(Npfilefid *fid, u64 offset, u32 count, u8 *data,
-                        Npreq *req) {
-    int n;
-    Npfile *file;
-    File *f;
+static void filerev_release(void *a) {
+    filerev_unref(a);
+}
 
-    file = fid->file;
-    f = file->aux;
+static void reader_destroy(void *a) {
+    Reader *r;
+
+    r = a;
+    r->epoch = 0;
+    __sync_synchronize();
+    r->active = 0;
+}
 
-//    FileRev *fr = file_readcopy(f);
-    FileRev *fr = filerev_alloc();
+static void reader_init_key(void) {
+    pthread_key_create(&reader_key, reader_destroy);
+}
 
-//    if(fid ->omode & Oappend)
-//        offset = fr->length;
-    offset = 0;
+static Reader *reader_get(void) {
+    Reader *r;
 
-    n = count;
-    if(fr->length < offset + count) {
-        if(filerev_truncate(fr, offset + count)) {
-            np_werror(Enospace, ENOSPC);
-            return 0;
-        }
+    pthread_once(&reader_once, reader_init_key);
+    r = pthread_getspecific(reader_key);
+    if(r)
+        return r;
 
-        if(offset + count > fr->datasize) {
-            if(fr->datasize - offset > 0)
-                n = fr->datasize - offset;
-            else
-                n = 0;
-        }
+    pthread_mutex_lock(&readers_lock);
+    for(r = readers; r; r = r->next)
+        if(!r->active)
+            break;
 
-        if(n) {
-            if(fr->length < offset)
-                memset(fr->data + fr->length, 0, offset - fr->length);
-            fr->length = offset + count;
+    if(!r) {
+        r = malloc(sizeof(Reader));
+        if(!r) {
+            pthread_mutex_unlock(&readers_lock);
+            return NULL;
         }
+
+        r->next = readers;
+        readers = r;
     }
+    r->epoch = 0;
+    r->active = 1;
+    pthread_mutex_unlock(&readers_lock);
 
-    if(n)
-        memmove(fr->data + offset, data, n);
+    pthread_setspecific(reader_key, r);
+    return r;
+}
 
-    pthread_mutex_lock(&f->wlock);
-    if(f->fr_write)
-        filerev_unref(f->fr_write);
-    f->fr_write = fr;
-    pthread_mutex_unlock(&f->wlock);
+static inline void reader_enter(Reader *r) {
+    r->epoch = read_epoch;
+    /* the epoch must be visible before we load any fr_read */
+    __sync_synchronize();
+}
 
-    filecommits_add(file);
+static inline void reader_exit(Reader *r) {
+    __sync_synchronize();
+    r->epoch = 0;
+}
 
-    return n;
+/* Called while committing for a revision that readers may still hold */
+static void filerev_retire(FileRev *fr, FileRev **list) {
+    fr->next = *list;
+    *list = fr;
 }
 
-static int syncfs_wstat(Npfile *file, Npstat *stat) {
-    File *f;
-    Npfile *nfile;
-    char *sname, *oldname;
-    int lockparent;
-    u64 length, oldlength;
-    u32 oldperm;
-    u32 oldmtime;
+/* Cut the history that ends at fr down to histdepth revisions before it */
+static void filerev_trim(FileRev *fr, FileRev **list) {
+    int i;
 
-    f = file->aux;
-    oldlength = ~0;
-    oldperm = ~0;
-    oldmtime = ~0;
-    oldname = NULL;
+    for(i = 0; i < histdepth && fr->prev; i++)
+        fr = fr->prev;
+    if(fr->prev) {
+        filerev_retire(fr->prev, list);
+        fr->prev = NULL;
+    }
+}
 
-    FileRev *fr = file_readcopy(f);
+/* Called by a tick thread once its tick is out: start a new epoch and hand
+ * what the commit replaced to the reclaimer.  Every domain advances the one
+ * epoch, so it is tagged and advanced under retired_lock to keep the list in
+ * epoch order. */
+static void filerev_reclaim(Domain *d) {
+    FileRev *fr;
 
-    lockparent = stat->name.len != 0;
-    if(lockparent)
-        pthread_mutex_lock(&file->parent->lock);
+    pthread_mutex_lock(&retired_lock);
+    __sync_synchronize();
+    if(d->retiring) {
+        for(fr = d->retiring; ; fr = fr->next) {
+            fr->epoch = read_epoch;
+            if(!fr->next)
+                break;
+        }
+        fr->next = retired;
+        retired = d->retiring;
+        d->retiring = NULL;
+    }
+    read_epoch++;
+    __sync_synchronize();
+    pthread_cond_signal(&retired_cond);
+    pthread_mutex_unlock(&retired_lock);
+}
 
-    if(stat->name.len != 0) {
-        sname = np_strdup(&stat->name);
+/* Free retired revisions once the readers have moved past them.  Epochs only
+ * grow, so the list is ordered and everything after the first revision that
+ * can go can go too. */
+static void *syncfs_reclaim_proc(void *a) {
+    u64 seen, oldest;
+    FileRev *pending, *fr, *next, **p;
+    Reader *r;
+    struct sched_param sp;
+
+    /* freeing is not worth the tick thread's priority */
+    sp.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+
+    pending = NULL;
+    seen = 0;
+    pthread_mutex_lock(&retired_lock);
+    for(;;) {
+        while(!retired && (!pending || seen == read_epoch))
+            pthread_cond_wait(&retired_cond, &retired_lock);
+
+        fr = retired;
+        retired = NULL;
+        seen = read_epoch;
+        pthread_mutex_unlock(&retired_lock);
+
+        /* what was just handed over is newer than anything pending */
+        if(fr) {
+            for(next = fr; next->next; next = next->next)
+                ;
+            next->next = pending;
+            pending = fr;
+        }
+
+        __sync_synchronize();
+        oldest = seen;
+        pthread_mutex_lock(&readers_lock);
+        for(r = readers; r; r = r->next)
+            if(r->epoch && r->epoch < oldest)
+                oldest = r->epoch;
+        pthread_mutex_unlock(&readers_lock);
+
+        for(p = &pending; *p && (*p)->epoch >= oldest; p = &(*p)->next)
+            ;
+        fr = *p;
+        *p = NULL;
+        for(; fr; fr = next) {
+            next = fr->next;
+            filerev_unref(fr);
+        }
+
+        pthread_mutex_lock(&retired_lock);
+    }
+
+    return NULL;
+}
+
+static File *file_alloc(void) {
+    File *f;
+
+    f = malloc(sizeof(File));
+
+    pthread_mutex_init(&f->wlock, NULL);
+
+    f->fr_read = filerev_alloc();
+    f->fr_write = NULL;
+    f->dom = NULL;
+    f->queuedtick = 0;
+    f->watchers.reqs = NULL;
+    f->watchers.count = 0;
+    f->watchers.size = 0;
+    f->kind = Rnone;
+    f->acc = 0;
+    f->accum = 0;
+    memset(&f->log, 0, sizeof(LogLimits));
+
+    return f;
+}
+
+/* The revision that the next commit will publish, cloned from the committed
+ * one on first use.  Called with f->wlock held. */
+static FileRev *file_pending(File *f) {
+    if(!f->fr_write)
+        f->fr_write = filerev_clone(f->fr_read);
+
+    return f->fr_write;
+}
+
+static void syncfs_connclose(Npconn *conn) {
+    /* Do nothing */
+}
+
+/* The revision a reader should see, with a reference taken */
+static FileRev *file_committed(File *f, Reader *r) {
+    u64 tick;
+    FileRev *fr;
+
+    reader_enter(r);
+    tick = f->dom->committed_tick;
+    __sync_synchronize();
+    fr = f->fr_read;
+    /* skip what a commit still in progress has installed */
+    while(fr->tick > tick)
+        fr = fr->prev;
+    filerev_ref(fr);
+    reader_exit(r);
+
+    return fr;
+}
+
+/* The revision that was current when tick came out, with a reference taken.
+ * A file keeps its last histdepth replaced revisions linked through prev,
+ * and the end of that list is cut off as commits add to it, so the list
+ * ends in NULL.  Without a history the revision before the current one is
+ * retired instead and must not be looked at. */
+static FileRev *file_at(File *f, u64 tick, Reader *r) {
+    u64 committed;
+    FileRev *fr;
+
+    reader_enter(r);
+    committed = f->dom->committed_tick;
+    __sync_synchronize();
+    if(tick > committed) {
+        reader_exit(r);
+        np_werror(Etickahead, EIO);
+        return NULL;
+    }
+
+    fr = f->fr_read;
+    while(fr->tick > committed)
+        fr = fr->prev;
+    while(fr && fr->tick > tick)
+        fr = histdepth ? fr->prev : NULL;
+    if(fr)
+        filerev_ref(fr);
+    reader_exit(r);
+
+    if(!fr)
+        np_werror(Enohistory, EIO);
+    return fr;
+}
+
+/* Point iov at bytes offset to end of fr, which must be within the file,
+ * and return how many entries that took.  A short chunk takes a second
+ * entry for the zeros after it, so that is at most two per chunk. */
+static int filerev_iov(FileRev *fr, u64 offset, u64 end, struct iovec *iov) {
+    int i;
+    u64 pos;
+    u32 n, m, off;
+    FileChunk *c;
+
+    i = 0;
+    if(fr->nchunks == 0 && end > offset) {
+        iov[i].iov_base = fr->data + offset;
+        iov[i++].iov_len = end - offset;
+    } else for(pos = offset; pos < end; pos += n) {
+        n = blksize - pos % blksize;
+        if(n > end - pos)
+            n = end - pos;
+
+        off = pos % blksize;
+        c = fr->chunks[pos / blksize];
+        m = c && off < c->size ? c->size - off : 0;
+        if(m > n)
+            m = n;
+
+        if(m) {
+            iov[i].iov_base = c->data + off;
+            iov[i++].iov_len = m;
+        }
+        if(m < n) {
+            iov[i].iov_base = zerochunk;
+            iov[i++].iov_len = n - m;
+        }
+    }
+
+    return i;
+}
+
+/* The reply points into the chunks of fr, whose reference it takes over and
+ * keeps until the reply has been sent */
+static Npfcall *filerev_rread(FileRev *fr, u64 offset, u32 count) {
+    int n;
+    u64 end;
+    Npfcall *ret;
+
+    if(offset < fr->base) {
+        filerev_unref(fr);
+        np_werror(Etrimmed, EIO);
+        return NULL;
+    }
+    offset -= fr->base;
+
+    end = offset;
+    if(offset < fr->length) {
+        end = offset + count;
+        if(end > fr->length || end < offset)
+            end = fr->length;
+    }
+
+    ret = np_alloc_rread_iov(end > offset ? 2 * filerev_nchunks(end - offset)
+                                            + 2 : 0);
+    if(!ret) {
+        filerev_unref(fr);
+        np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    n = filerev_iov(fr, offset, end, ret->iov + 1);
+    np_set_rread_iov(ret, end - offset, n, filerev_release, fr);
+    return ret;
+}
+
+/* Park req, which found fr committed, until a commit replaces it: on the
+ * file, or on the domain if the replacement is already installed and only
+ * waiting for its tick to come out.  Called with the file's wlock held;
+ * takes over the reference to fr. */
+static Npfcall *watch_park(File *f, FileRev *fr, Npreq *req) {
+    int ret;
+    Domain *d;
+
+    filerev_unref(fr);
+    if(f->fr_read == fr)
+        ret = reqlist_push(&f->watchers, req);
+    else {
+        d = f->dom;
+        pthread_mutex_lock(&d->waiters_lock);
+        ret = reqlist_push(&d->waiters, req);
+        pthread_mutex_unlock(&d->waiters_lock);
+    }
+
+    if(ret)
+        np_werror(Enomem, ENOMEM);
+    return NULL;
+}
+
+/* A read through an Owatch fid.  Returns NULL with no error when the
+ * request has been parked: on the file until a commit replaces the
+ * revision last read, or on the domain if the replacement is already
+ * installed and only waiting for its tick to come out.  A log is tailed
+ * instead, with a read at its end waiting for more to be committed. */
+static Npfcall *watch_read(Npfilefid *fid, u64 offset, u32 count,
+                           Npreq *req) {
+    int wait;
+    File *f;
+    FileRev *fr;
+    FileFid *w;
+    Reader *r;
+
+    f = fid->file->aux;
+    r = reader_get();
+    if(!r) {
+        np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&f->wlock);
+    w = fid->aux;
+    if(!w) {
+        w = calloc(1, sizeof(FileFid));
+        if(!w) {
+            pthread_mutex_unlock(&f->wlock);
+            np_werror(Enomem, ENOMEM);
+            return NULL;
+        }
+        fid->aux = w;
+    }
+
+    fr = file_committed(f, r);
+    if(f->kind == Rlog)
+        wait = offset >= fr->base + fr->length;
+    else
+        wait = offset == 0 && fr == w->seen;
+    if(wait) {
+        watch_park(f, fr, req);
+        pthread_mutex_unlock(&f->wlock);
+        return NULL;
+    }
+
+    if(f->kind == Rlog) {
+        pthread_mutex_unlock(&f->wlock);
+        return filerev_rread(fr, offset, count);
+    }
+
+    if(offset != 0 && w->seen) {
+        filerev_unref(fr);
+        fr = w->seen;
+        filerev_ref(fr);
+    } else if(fr != w->seen) {
+        if(w->seen)
+            filerev_unref(w->seen);
+        w->seen = fr;
+        filerev_ref(fr);
+    }
+    pthread_mutex_unlock(&f->wlock);
+
+    return filerev_rread(fr, offset, count);
+}
+
+/* The length in the header of the queue message at offset */
+static u32 queue_header(FileRev *fr, u64 offset) {
+    int i, n;
+    u8 buf[4], *p;
+    struct iovec iov[6];
+
+    offset -= fr->base;
+    n = filerev_iov(fr, offset, offset + sizeof(buf), iov);
+    for(p = buf, i = 0; i < n; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    return buf[0] | buf[1] << 8 | buf[2] << 16 | (u32) buf[3] << 24;
+}
+
+/* A read of a queue, from the fid's cursor.  Returns NULL with no error
+ * when the request has been parked until more is committed. */
+static Npfcall *queue_read(Npfilefid *fid, u32 count, Npreq *req) {
+    int i;
+    u64 offset, end;
+    File *f;
+    FileRev *fr;
+    FileFid *w;
+    Reader *r;
+    LogLimits *l;
+
+    f = fid->file->aux;
+    r = reader_get();
+    if(!r) {
+        np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&f->wlock);
+    w = fid->aux;
+    fr = file_committed(f, r);
+    end = fr->base + fr->length;
+    if(w->cursor < fr->base) {
+        /* go on from the first tick whose messages are all still there */
+        l = &f->log;
+        for(i = 0; i < l->nmarks && l->marks[i].offset < fr->base; i++)
+            ;
+        w->cursor = end;
+        if(i < l->nmarks && l->marks[i].offset < end)
+            w->cursor = l->marks[i].offset;
+        w->left = 0;
+        pthread_mutex_unlock(&f->wlock);
+
+        filerev_unref(fr);
+        np_werror(Equeuelost, EIO);
+        return NULL;
+    }
+
+    if(w->cursor >= end) {
+        watch_park(f, fr, req);
+        pthread_mutex_unlock(&f->wlock);
+        return NULL;
+    }
+
+    if(!w->left) {
+        w->left = queue_header(fr, w->cursor);
+        w->cursor += 4;
+    }
+    if(count > w->left)
+        count = w->left;
+    offset = w->cursor;
+    w->cursor += count;
+    w->left -= count;
+    pthread_mutex_unlock(&f->wlock);
+
+    return filerev_rread(fr, offset, count);
+}
+
+static Npfcall *syncfs_readv(Npfilefid *fid, u64 offset, u32 count,
+                             Npreq *req) {
+    File *f;
+    FileFid *w;
+    FileRev *fr;
+    Reader *r;
+
+    f = fid->file->aux;
+    w = fid->aux;
+    if(f->kind == Rqueue && !(w && w->tick))
+        return queue_read(fid, count, req);
+    if(fid->omode & Owatch && !(w && w->tick))
+        return watch_read(fid, offset, count, req);
+
+    r = reader_get();
+    if(!r) {
+        np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    if(w && w->tick) {
+        fr = file_at(f, w->tick, r);
+        if(!fr)
+            return NULL;
+    } else
+        fr = file_committed(f, r);
+
+    return filerev_rread(fr, offset, count);
+}
+
+static void snapshot_unref(void *a) {
+    int i;
+    Snapshot *s;
+
+    s = a;
+    if(__sync_sub_and_fetch(&s->refs, 1) != 0)
+        return;
+
+    for(i = 0; i < s->count; i++)
+        if(s->entries[i].fr)
+            filerev_unref(s->entries[i].fr);
+    free(s->entries);
+    free(s->hdr);
+    free(s);
+}
+
+static void filefid_free(FileFid *w) {
+    if(w->seen)
+        filerev_unref(w->seen);
+    if(w->dir)
+        npfile_decref(w->dir);
+    if(w->snap)
+        snapshot_unref(w->snap);
+    free(w->errors);
+    free(w);
+}
+
+/* A fid opened on a queue reads only what is committed after */
+static int syncfs_open(Npfilefid *fid) {
+    File *f;
+    FileFid *w;
+    FileRev *fr;
+    Reader *r;
+
+    f = fid->file->aux;
+    w = fid->aux;
+    if(f->kind != Rqueue || (w && w->tick))
+        return 1;
+
+    r = reader_get();
+    if(!r) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+
+    if(!w) {
+        w = calloc(1, sizeof(FileFid));
+        if(!w) {
+            np_werror(Enomem, ENOMEM);
+            return 0;
+        }
+        fid->aux = w;
+    }
+
+    pthread_mutex_lock(&f->wlock);
+    fr = file_committed(f, r);
+    w->cursor = fr->base + fr->length;
+    pthread_mutex_unlock(&f->wlock);
+    filerev_unref(fr);
+
+    return 1;
+}
+
+static void syncfs_closefid(Npfilefid *fid) {
+    if(fid->aux) {
+        filefid_free(fid->aux);
+        fid->aux = NULL;
+    }
+}
+
+/* Add a record for fr, which the snapshot takes a reference to, or with a
+ * NULL fr the tick that starts the archive */
+static int snapshot_push(Snapshot *s, char *name, int namelen, FileRev *fr,
+                         u64 tick) {
+    int i;
+    u32 n;
+    u64 length;
+    u8 *p;
+    SnapEntry *e;
+
+    if(s->count == s->size) {
+        e = realloc(s->entries, (s->size * 2 + 16) * sizeof(SnapEntry));
+        if(!e)
+            return -1;
+        s->entries = e;
+        s->size = s->size * 2 + 16;
+    }
+
+    n = fr ? 2 + namelen + 8 : 8;
+    if(s->hdrlen + n > s->hdrsize) {
+        p = realloc(s->hdr, s->hdrsize * 2 + n + 4096);
+        if(!p)
+            return -1;
+        s->hdr = p;
+        s->hdrsize = s->hdrsize * 2 + n + 4096;
+    }
+
+    p = s->hdr + s->hdrlen;
+    length = tick;
+    if(fr) {
+        p[0] = namelen;
+        p[1] = namelen >> 8;
+        memcpy(p + 2, name, namelen);
+        p += 2 + namelen;
+        length = fr->length;
+        filerev_ref(fr);
+    }
+    for(i = 0; i < 8; i++)
+        p[i] = length >> (8 * i);
+
+    e = &s->entries[s->count++];
+    e->fr = fr;
+    e->start = s->length;
+    e->hdroff = s->hdrlen;
+    e->hdrlen = n;
+    s->hdrlen += n;
+    s->length += n + (fr ? fr->length : 0);
+
+    return 0;
+}
+
+/* Add the files below dir as they were at tick.  Called in a read epoch, so
+ * that the revisions that commits replace since tick stay around.  Returns
+ * 1 if a file's history no longer reaches back to tick. */
+static int snapshot_add(Snapshot *s, Npfile *dir, char *path, int pathlen,
+                        u64 tick) {
+    int i, n, ret, namelen;
+    u64 t;
+    char *name;
+    Npfile *file, **files;
+    File *f;
+    FileRev *fr;
+
+    /* wstat locks a file before its directory, so take the children
+     * without holding on to the directory */
+    n = 0;
+    files = NULL;
+    pthread_mutex_lock(&dir->lock);
+    for(file = dir->dirfirst; file; file = file->next)
+        n++;
+    if(n)
+        files = malloc(n * sizeof(Npfile *));
+    if(n && !files) {
+        pthread_mutex_unlock(&dir->lock);
+        np_werror(Enomem, ENOMEM);
+        return -1;
+    }
+    for(i = 0, file = dir->dirfirst; file; file = file->next) {
+        npfile_incref(file);
+        files[i++] = file;
+    }
+    pthread_mutex_unlock(&dir->lock);
+
+    ret = 0;
+    for(i = 0; i < n; i++) {
+        file = files[i];
+        f = file->aux;
+        if(ret || (!(file->mode & Dmdir) && file->ops != &fileops)) {
+            npfile_decref(file);
+            continue;
+        }
+
+        namelen = pathlen + (pathlen != 0) + strlen(file->name);
+        if(namelen > 0xffff) {
+            np_werror(Etoolong, ENAMETOOLONG);
+            ret = -1;
+            npfile_decref(file);
+            continue;
+        }
+
+        name = malloc(namelen + 1);
+        if(!name) {
+            np_werror(Enomem, ENOMEM);
+            ret = -1;
+            npfile_decref(file);
+            continue;
+        }
+        sprintf(name, "%.*s%s%s", pathlen, path, pathlen ? "/" : "",
+                file->name);
+
+        if(file->mode & Dmdir) {
+            t = tick;
+            if(f->dom != ((File *) dir->aux)->dom)
+                t = f->dom->committed_tick;
+            ret = snapshot_add(s, file, name, namelen, t);
+        } else {
+            for(fr = f->fr_read; fr && fr->tick > tick; fr = fr->prev)
+                ;
+            if(!fr)
+                ret = 1;
+            else if(snapshot_push(s, name, namelen, fr, 0)) {
+                np_werror(Enomem, ENOMEM);
+                ret = -1;
+            }
+        }
+
+        free(name);
+        npfile_decref(file);
+    }
+    free(files);
+
+    return ret;
+}
+
+static int snapshot_open(Npfilefid *fid) {
+    int i, ret;
+    u64 tick;
+    FileFid *w;
+    Snapshot *s;
+    Reader *r;
+
+    w = fid->aux;
+    r = reader_get();
+    s = calloc(1, sizeof(Snapshot));
+    if(!r || !s) {
+        free(s);
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+    s->refs = 1;
+
+    /* a file that changes more often than it keeps history for while this
+     * runs makes it start over at a later tick */
+    do {
+        for(i = 0; i < s->count; i++)
+            if(s->entries[i].fr)
+                filerev_unref(s->entries[i].fr);
+        s->count = 0;
+        s->hdrlen = 0;
+        s->length = 0;
+
+        reader_enter(r);
+        tick = ((File *) w->dir->aux)->dom->committed_tick;
+        __sync_synchronize();
+        ret = snapshot_push(s, NULL, 0, NULL, tick);
+        if(ret)
+            np_werror(Enomem, ENOMEM);
+        else
+            ret = snapshot_add(s, w->dir, "", 0, tick);
+        reader_exit(r);
+    } while(ret == 1);
+
+    if(ret) {
+        snapshot_unref(s);
+        return 0;
+    }
+
+    w->snap = s;
+    return 1;
+}
+
+/* The reply points into the snapshot, which it keeps a reference to */
+static Npfcall *snapshot_readv(Npfilefid *fid, u64 offset, u32 count,
+                               Npreq *req) {
+    int i, lo, hi, n;
+    u64 end, a, b, start;
+    Snapshot *s;
+    SnapEntry *e;
+    Npfcall *ret;
+
+    s = ((FileFid *) fid->aux)->snap;
+    end = offset;
+    if(offset < s->length) {
+        end = offset + count;
+        if(end > s->length || end < offset)
+            end = s->length;
+    }
+
+    /* the last record that starts at or before offset */
+    lo = 0;
+    hi = s->count - 1;
+    while(lo < hi) {
+        i = (lo + hi + 1) / 2;
+        if(s->entries[i].start <= offset)
+            lo = i;
+        else
+            hi = i - 1;
+    }
+
+    n = 0;
+    for(i = lo; i < s->count && s->entries[i].start < end; i++) {
+        e = &s->entries[i];
+        n++;
+        if(e->fr && e->fr->length)
+            n += 2 * filerev_nchunks(e->fr->length) + 2;
+    }
+
+    ret = np_alloc_rread_iov(n);
+    if(!ret) {
+        np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    n = 1;
+    for(i = lo; i < s->count && s->entries[i].start < end; i++) {
+        e = &s->entries[i];
+        a = offset > e->start ? offset : e->start;
+        b = end < e->start + e->hdrlen ? end : e->start + e->hdrlen;
+        if(a < b) {
+            ret->iov[n].iov_base = s->hdr + e->hdroff + (a - e->start);
+            ret->iov[n++].iov_len = b - a;
+        }
+
+        if(!e->fr)
+            continue;
+        start = e->start + e->hdrlen;
+        a = offset > start ? offset : start;
+        b = end < start + e->fr->length ? end : start + e->fr->length;
+        if(a < b)
+            n += filerev_iov(e->fr, a - start, b - start, ret->iov + n);
+    }
+
+    __sync_fetch_and_add(&s->refs, 1);
+    np_set_rread_iov(ret, end - offset, n - 1, snapshot_unref, s);
+    return ret;
+}
+
+/* Writing a number of milliseconds to a clock file sets the period of its
+ * domain, from the next tick on */
+static int domain_setperiod(Domain *d, u32 count, u8 *data) {
+    long int ms;
+    char buf[32], *s;
+
+    if(count >= sizeof(buf)) {
+        np_werror(Ebadperiod, EINVAL);
+        return 0;
+    }
+
+    memcpy(buf, data, count);
+    buf[count] = '\0';
+    ms = strtol(buf, &s, 10);
+    while(*s == ' ' || *s == '\t' || *s == '\n')
+        s++;
+    if(s == buf || *s != '\0' || ms <= 0) {
+        np_werror(Ebadperiod, EINVAL);
+        return 0;
+    }
+
+    d->period = ms * 1000000;
+    return count;
+}
+
+/* Fold a write into what the file's domain commits next */
+static int file_reduce(Npfile *file, u32 count, u8 *data) {
+    int first, len;
+    u32 n;
+    u64 v;
+    char buf[32], *s;
+    File *f;
+    FileRev *fr;
+
+    f = file->aux;
+    v = 0;
+    if(f->kind != Rappend) {
+        if(count == 0 || count >= sizeof(buf)) {
+            np_werror(Ebadvalue, EINVAL);
+            return 0;
+        }
+        memcpy(buf, data, count);
+        buf[count] = '\0';
+        errno = 0;
+        if(f->kind == Ror)
+            v = strtoull(buf, &s, 0);
+        else
+            v = strtoll(buf, &s, 0);
+        while(isspace(*s))
+            s++;
+        if(s == buf || *s != '\0' || errno) {
+            np_werror(Ebadvalue, EINVAL);
+            return 0;
+        }
+    }
+
+    n = 0;
+    pthread_mutex_lock(&f->wlock);
+    first = !f->accum;
+    fr = file_pending(f);
+    if(fr && f->kind == Rappend) {
+        if(!first || !filerev_truncate(fr, 0))
+            n = filerev_write(fr, fr->length, count, data);
+    } else if(fr) {
+        if(first)
+            f->acc = v;
+        else switch(f->kind) {
+        case Rsum:
+            f->acc += v;
+            break;
+        case Rmin:
+            if((int64_t) v < (int64_t) f->acc)
+                f->acc = v;
+            break;
+        case Rmax:
+            if((int64_t) v > (int64_t) f->acc)
+                f->acc = v;
+            break;
+        case Ror:
+            f->acc |= v;
+            break;
+        }
+
+        if(f->kind == Ror)
+            len = sprintf(buf, "%llu\n", (unsigned long long) f->acc);
+        else
+            len = sprintf(buf, "%lld\n", (long long) f->acc);
+        if(!filerev_truncate(fr, 0) && filerev_write(fr, 0, len, (u8 *) buf)
+                                       == len)
+            n = count;
+    }
+    if(fr)
+        f->accum = 1;
+    pthread_mutex_unlock(&f->wlock);
+
+    if(n < count) {
+        np_werror(Enospace, ENOSPC);
+        return 0;
+    }
+
+    if(filecommits_add(file, 0)) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+
+    return count;
+}
+
+/* Drop what a log no longer has to keep from the front of fr, which is
+ * about to be committed in tick.  The last chunk always stays, so the
+ * revision never has to go back to keeping its data inline. */
+static void log_trim(LogLimits *l, FileRev *fr, u64 tick) {
+    int i;
+    u64 cut, n;
+
+    cut = fr->base;
+    if(l->bytes && fr->length > l->bytes)
+        cut = fr->base + fr->length - l->bytes;
+
+    for(i = 0; i < l->nmarks && l->marks[i].tick + l->ticks <= tick; i++)
+        ;
+    if(i) {
+        if(i < l->nmarks && l->marks[i].offset > cut)
+            cut = l->marks[i].offset;
+        else if(i == l->nmarks)
+            cut = fr->base + fr->length;
+        l->nmarks -= i;
+        memmove(l->marks, l->marks + i, l->nmarks * sizeof(LogMark));
+    }
+
+    n = (cut - fr->base) / blksize;
+    if(fr->nchunks == 0 || n == 0)
+        return;
+    if(n > fr->nchunks - 1)
+        n = fr->nchunks - 1;
+
+    for(i = 0; i < n; i++)
+        filechunk_unref(fr->chunks[i]);
+    memmove(fr->chunks, fr->chunks + n,
+            (fr->nchunks - n) * sizeof(FileChunk *));
+    fr->nchunks -= n;
+    fr->length -= n * blksize;
+    fr->base += n * blksize;
+}
+
+/* Append a write to a log, wherever it was aimed, or to a queue as a message
+ * with its length in front */
+static int file_log(Npfile *file, u32 count, u8 *data) {
+    u32 n, hdr;
+    u64 tick;
+    File *f;
+    FileRev *fr;
+    LogLimits *l;
+    LogMark *m;
+    u8 len[4];
+
+    f = file->aux;
+    l = &f->log;
+    if(f->kind == Rqueue && count == 0)
+        return 0;
+
+    n = 0;
+    hdr = 0;
+    pthread_mutex_lock(&f->wlock);
+    fr = file_pending(f);
+    if(fr) {
+        /* the tick this write goes out in, unless one is committing */
+        tick = f->dom->committed_tick + 1;
+        if(l->ticks && (!l->nmarks || l->marks[l->nmarks - 1].tick != tick)) {
+            if(l->nmarks == l->size) {
+                m = realloc(l->marks, (l->size * 2 + 8) * sizeof(LogMark));
+                if(m) {
+                    l->marks = m;
+                    l->size = l->size * 2 + 8;
+                }
+            }
+            if(l->nmarks < l->size) {
+                l->marks[l->nmarks].tick = tick;
+                l->marks[l->nmarks++].offset = fr->base + fr->length;
+            }
+        }
+
+        if(f->kind == Rqueue) {
+            len[0] = count;
+            len[1] = count >> 8;
+            len[2] = count >> 16;
+            len[3] = count >> 24;
+            hdr = filerev_write(fr, fr->length, sizeof(len), len);
+            if(hdr < sizeof(len))
+                filerev_truncate(fr, fr->length - hdr);
+        }
+        if(hdr == (f->kind == Rqueue ? sizeof(len) : 0)) {
+            n = filerev_write(fr, fr->length, count, data);
+            if(hdr && n < count)
+                filerev_truncate(fr, fr->length - n - hdr);
+        }
+        log_trim(l, fr, tick);
+    }
+    pthread_mutex_unlock(&f->wlock);
+
+    if(n < count) {
+        np_werror(Enospace, ENOSPC);
+        return 0;
+    }
+
+    if(filecommits_add(file, 0)) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+
+    return count;
+}
+
+static int syncfs_write(Npfilefid *fid, u64 offset, u32 count, u8 *data,
+                        Npreq *req) {
+    int n;
+    Npfile *file;
+    File *f;
+    FileRev *fr;
+
+    file = fid->file;
+    f = file->aux;
+    n = 0;
+
+    if(fid->aux && ((FileFid *) fid->aux)->tick) {
+        np_werror(Eperm, EPERM);
+        return 0;
+    }
+
+    if(file == f->dom->clkfile)
+        return domain_setperiod(f->dom, count, data);
+
+    if(f->kind == Rlog || f->kind == Rqueue)
+        return file_log(file, count, data);
+    if(f->kind)
+        return file_reduce(file, count, data);
+
+    pthread_mutex_lock(&f->wlock);
+    fr = file_pending(f);
+    if(fr) {
+        if(fid->omode & Oappend)
+            offset = fr->length;
+        n = filerev_adopt(fr, offset, count, data, req);
+        if(n < count)
+            n += filerev_write(fr, offset + n, count - n, data + n);
+    }
+    pthread_mutex_unlock(&f->wlock);
+
+    if(n == 0 && count != 0) {
+        np_werror(Enospace, ENOSPC);
+        return 0;
+    }
+
+    if(filecommits_add(file, 0)) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+
+    return n;
+}
+
+/* Find the data file at path from dir that user may write to, with a
+ * reference taken, or NULL with the error set */
+static Npfile *batch_lookup(Npfile *dir, u8 *path, int len, Npuser *user) {
+    int i, n;
+    char name[256];
+    Npfile *file, *next;
+
+    file = dir;
+    npfile_incref(file);
+    for(i = 0; i <= len; i += n + 1) {
+        for(n = 0; i + n < len && path[i + n] != '/'; n++)
+            ;
+        if(n == 0 || n >= sizeof(name) || !(file->mode & Dmdir)) {
+            npfile_decref(file);
+            np_werror(Enotfound, ENOENT);
+            return NULL;
+        }
+
+        memcpy(name, path + i, n);
+        name[n] = '\0';
+        if(!strcmp(name, ".") || !strcmp(name, "..") ||
+           !npfile_checkperm(file, user, 1)) {
+            npfile_decref(file);
+            if(!np_haserror())
+                np_werror(Enotfound, ENOENT);
+            return NULL;
+        }
+
+        next = npfile_find(file, name);
+        npfile_decref(file);
+        if(!next) {
+            if(!np_haserror())
+                np_werror(Enotfound, ENOENT);
+            return NULL;
+        }
+        file = next;
+    }
+
+    if(file->mode & Dmdir || file->ops != &fileops ||
+       file == ((File *) file->aux)->dom->clkfile) {
+        npfile_decref(file);
+        np_werror(Eperm, EPERM);
+        return NULL;
+    }
+
+    if(!npfile_checkperm(file, user, 2)) {
+        npfile_decref(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/* Replace what the next commit of file will publish with data, or for a
+ * reduction file fold data into it */
+static int batch_apply(Npfile *file, u32 count, u8 *data) {
+    u32 n;
+    File *f;
+    FileRev *fr;
+
+    f = file->aux;
+    if(f->kind == Rlog || f->kind == Rqueue)
+        return file_log(file, count, data) == count ? 0 : -1;
+    if(f->kind)
+        return file_reduce(file, count, data) == count ? 0 : -1;
+
+    n = 0;
+    pthread_mutex_lock(&f->wlock);
+    fr = file_pending(f);
+    if(fr && !filerev_truncate(fr, 0))
+        n = filerev_write(fr, 0, count, data);
+    pthread_mutex_unlock(&f->wlock);
+
+    if(n < count) {
+        np_werror(Enospace, ENOSPC);
+        return -1;
+    }
+
+    if(filecommits_add(file, 0)) {
+        np_werror(Enomem, ENOMEM);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Add a line for record i with the error it got to the fid's next report,
+ * and clear the error */
+static void batch_error(char **errors, int *len, int *size, int i) {
+    int ecode, n;
+    char *ename, *p;
+
+    np_rerror(&ename, &ecode);
+    n = strlen(ename) + 16;
+    if(*len + n > *size) {
+        p = realloc(*errors, *size * 2 + n);
+        if(p) {
+            *errors = p;
+            *size = *size * 2 + n;
+        }
+    }
+    if(*len + n <= *size)
+        *len += sprintf(*errors + *len, "%d %s\n", i, ename);
+    np_werror(NULL, 0);
+}
+
+static inline u32 batch_get32(u8 *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24;
+}
+
+/* The files are looked up first so that the commit is kept waiting only
+ * while they are written */
+static int batch_write(Npfilefid *fid, u64 offset, u32 count, u8 *data,
+                       Npreq *req) {
+    int i, n, len, size;
+    u32 pos, namelen, datalen;
+    char *errors;
+    Npfile **files;
+    FileFid *w;
+    Domain *d;
+
+    /* check the whole write parses before applying any of it */
+    n = 0;
+    for(pos = 0; pos < count; pos += 2 + namelen + 4 + datalen, n++) {
+        if(count - pos < 2)
+            break;
+        namelen = data[pos] | data[pos + 1] << 8;
+        if(count - pos - 2 < namelen + 4)
+            break;
+        datalen = batch_get32(data + pos + 2 + namelen);
+        if(count - pos - 2 - namelen - 4 < datalen)
+            break;
+    }
+    if(pos != count) {
+        np_werror(Ebadbatch, EINVAL);
+        return 0;
+    }
+
+    files = n ? malloc(n * sizeof(Npfile *)) : NULL;
+    if(n && !files) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+
+    w = fid->aux;
+    d = ((File *) w->dir->aux)->dom;
+    errors = NULL;
+    len = 0;
+    size = 0;
+
+    for(i = 0, pos = 0; i < n; i++, pos += 2 + namelen + 4 + datalen) {
+        namelen = data[pos] | data[pos + 1] << 8;
+        datalen = batch_get32(data + pos + 2 + namelen);
+        files[i] = batch_lookup(w->dir, data + pos + 2, namelen,
+                                fid->fid->user);
+        if(files[i] && ((File *) files[i]->aux)->dom != d) {
+            npfile_decref(files[i]);
+            files[i] = NULL;
+            np_werror(Eotherdomain, EXDEV);
+        }
+        if(!files[i])
+            batch_error(&errors, &len, &size, i);
+    }
+
+    pthread_mutex_lock(&d->batch_lock);
+    for(i = 0, pos = 0; i < n; i++, pos += 2 + namelen + 4 + datalen) {
+        namelen = data[pos] | data[pos + 1] << 8;
+        datalen = batch_get32(data + pos + 2 + namelen);
+        if(files[i] && batch_apply(files[i], datalen,
+                                   data + pos + 2 + namelen + 4))
+            batch_error(&errors, &len, &size, i);
+    }
+    pthread_mutex_unlock(&d->batch_lock);
+
+    for(i = 0; i < n; i++)
+        if(files[i])
+            npfile_decref(files[i]);
+    free(files);
+
+    pthread_mutex_lock(&fid->lock);
+    free(w->errors);
+    w->errors = errors;
+    w->errorslen = len;
+    pthread_mutex_unlock(&fid->lock);
+
+    return count;
+}
+
+static Npfcall *batch_readv(Npfilefid *fid, u64 offset, u32 count,
+                            Npreq *req) {
+    u32 n;
+    FileFid *w;
+    Npfcall *rc;
+
+    w = fid->aux;
+    pthread_mutex_lock(&fid->lock);
+    n = 0;
+    if(offset < w->errorslen) {
+        n = w->errorslen - offset;
+        if(n > count)
+            n = count;
+    }
+
+    rc = np_alloc_rread(n);
+    if(!rc) {
+        pthread_mutex_unlock(&fid->lock);
+        np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    if(n)
+        memcpy(rc->data, w->errors + offset, n);
+    pthread_mutex_unlock(&fid->lock);
+
+    np_set_rread_count(rc, n);
+    return rc;
+}
+
+static int participant_open(Npfilefid *fid) {
+    Participant *p;
+    Domain *d;
+
+    p = malloc(sizeof(Participant));
+    if(!p) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+
+    d = ((File *) fid->file->aux)->dom;
+    pthread_mutex_lock(&d->barrier_lock);
+    p->gen = 0;
+    d->nparticipants++;
+    pthread_mutex_unlock(&d->barrier_lock);
+
+    fid->aux = p;
+    return 1;
+}
+
+/* Leaving may be what the others were waiting for */
+static void participant_close(Npfilefid *fid) {
+    Participant *p;
+    Domain *d;
+
+    p = fid->aux;
+    if(!p)
+        return;
+
+    d = ((File *) fid->file->aux)->dom;
+    pthread_mutex_lock(&d->barrier_lock);
+    d->nparticipants--;
+    if(p->gen == d->barriergen)
+        d->narrived--;
+    pthread_cond_signal(&d->barrier_cond);
+    pthread_mutex_unlock(&d->barrier_lock);
+
+    fid->aux = NULL;
+    free(p);
+}
+
+/* Arrive at the next tick; what is written does not matter */
+static int participant_write(Npfilefid *fid, u64 offset, u32 count, u8 *data,
+                             Npreq *req) {
+    Participant *p;
+    Domain *d;
+
+    p = fid->aux;
+    d = ((File *) fid->file->aux)->dom;
+    pthread_mutex_lock(&d->barrier_lock);
+    if(p->gen != d->barriergen) {
+        p->gen = d->barriergen;
+        if(++d->narrived == d->nparticipants)
+            pthread_cond_signal(&d->barrier_cond);
+    }
+    pthread_mutex_unlock(&d->barrier_lock);
+
+    return count;
+}
+
+/* A shell truncates what it opens for writing, which means nothing here */
+static int participant_wstat(Npfile *file, Npstat *stat) {
+    if(stat->name.len != 0 || stat->mode != (u32) ~0 ||
+       stat->mtime != (u32) ~0) {
+        np_werror(Eperm, EPERM);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int syncfs_wstat(Npfile *file, Npstat *stat) {
+    File *f;
+    Npfile *nfile;
+    char *sname, *oldname;
+    int lockparent;
+    u32 oldperm;
+    u32 oldmtime;
+    FileRev *fr;
+
+    f = file->aux;
+    oldperm = ~0;
+    oldmtime = ~0;
+    oldname = NULL;
+
+    lockparent = stat->name.len != 0;
+    if(lockparent)
+        pthread_mutex_lock(&file->parent->lock);
+
+    if(stat->name.len != 0) {
+        sname = np_strdup(&stat->name);
         nfile = npfile_find(file->parent, sname);
         if(nfile) {
             free(sname);
             np_werror(Eexist, EEXIST);
             goto error;
         } else
-            npfile_decref(nfile);
+            npfile_decref(nfile);
+
+        oldname = file->name;
+        file->name = sname;
+    }
+
+    if(stat->length != (u64) ~0) {
+        pthread_mutex_lock(&f->wlock);
+        fr = file_pending(f);
+        if(!fr || filerev_truncate(fr, stat->length)) {
+            pthread_mutex_unlock(&f->wlock);
+            np_werror(Enospace, ENOSPC);
+            goto error;
+        }
+        pthread_mutex_unlock(&f->wlock);
+    }
+
+    if(stat->mode != (u32) ~0) {
+        oldperm = file->mode;
+        file->mode = stat->mode;
+    }
+
+    if(stat->mtime != (u32) ~0) {
+        oldmtime = file->mtime;
+        file->mtime = stat->mtime;
+    }
+
+    free(oldname);
+    if(lockparent)
+        pthread_mutex_unlock(&file->parent->lock);
+
+    if(stat->length != (u64) ~0) {
+        /* npfile_wstat and npfile_open call us with file->lock held */
+        if(filecommits_add(file, 1)) {
+            np_werror(Enomem, ENOMEM);
+            return 0;
+        }
+    }
+
+    return 1;
+
+error:
+    if(oldname) {
+        free(file->name);
+        file->name = oldname;
+    }
+
+    if(oldperm != ~0)
+        file->mode = oldperm;
+
+    if(oldmtime != ~0)
+        file->mtime = oldmtime;
+
+    if(lockparent)
+        pthread_mutex_unlock(&file->parent->lock);
+
+    return 0;
+}
+
+static void syncfs_destroy(Npfile *file) {
+    File *f;
+    FileRev *fr, *prev;
+
+    /* nobody has the file open, so there can be no readers of fr_read or
+     * of the history behind it */
+    f = file->aux;
+    pthread_mutex_lock(&f->wlock);
+    for(fr = f->fr_read; fr; fr = prev) {
+        prev = histdepth ? fr->prev : NULL;
+        filerev_unref(fr);
+    }
+    f->fr_read = NULL;
+    if(f->fr_write) {
+        filerev_unref(f->fr_write);
+        f->fr_write = NULL;
+    }
+    pthread_mutex_unlock(&f->wlock);
+    free(f->watchers.reqs);
+    free(f->log.marks);
+    free(f);
+}
+
+static Domain *domain_alloc(Npfile *dir, long int period) {
+    Domain *d;
+    pthread_condattr_t attr;
+
+    d = calloc(1, sizeof(Domain));
+    if(!d)
+        return NULL;
+
+    d->workers = calloc(ncommitworkers, sizeof(CommitWorker));
+    if(!d->workers) {
+        free(d);
+        return NULL;
+    }
+
+    d->dir = dir;
+    d->period = period;
+    d->commits_cur = &d->commits[0];
+    d->commits_tick = 1;
+    d->barriergen = 1;
+    pthread_mutex_init(&d->barrier_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&d->barrier_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&d->changes_lock, NULL);
+    pthread_mutex_init(&d->commits_lock, NULL);
+    pthread_mutex_init(&d->batch_lock, NULL);
+    pthread_mutex_init(&d->commit_lock, NULL);
+    pthread_cond_init(&d->commit_done_cond, NULL);
+    pthread_mutex_init(&d->waiters_lock, NULL);
+
+    pthread_mutex_lock(&domains_lock);
+    d->next = domains;
+    domains = d;
+    pthread_mutex_unlock(&domains_lock);
+
+    return d;
+}
+
+/* Undo domain_alloc for a domain that never started */
+static void domain_free(Domain *d) {
+    Domain **pd;
+
+    pthread_mutex_lock(&domains_lock);
+    for(pd = &domains; *pd; pd = &(*pd)->next)
+        if(*pd == d) {
+            *pd = d->next;
+            break;
+        }
+    pthread_mutex_unlock(&domains_lock);
+
+    free(d->workers);
+    free(d);
+}
+
+/* Add a file to the end of dir, which holds the one reference returned */
+static Npfile *syncfs_mknode(Npfile *dir, char *name, u32 perm, Npuser *uid,
+                             Npgroup *gid, char *extension, void *ops) {
+    Npfile *file;
+    File *f;
+
+    f = file_alloc();
+    f->dom = ((File *) dir->aux)->dom;
+
+    file = npfile_alloc(dir, name, perm, qidpath++, ops, f);
+    file->uid = uid;
+    file->gid = gid;
+    file->muid = uid;
+    npfile_incref(file);
+
+    if(dir->dirlast) {
+        dir->dirlast->next = file;
+        file->prev = dir->dirlast;
+    } else
+        dir->dirfirst = file;
+
+    dir->dirlast = file;
+    file->extension = strdup(extension);
+
+    return file;
+}
+
+/* The kind of file an extension asks for, or Rnone */
+static int kind_parse(char *extension, LogLimits *log) {
+    int kind, n;
+    u64 *limit;
+    char *s, *e;
+
+    for(kind = Rsum; kind <= Rqueue; kind++) {
+        n = strlen(kindnames[kind]);
+        if(!strncmp(extension, kindnames[kind], n) &&
+           (extension[n] == '\0' || (kind >= Rlog && extension[n] == ' ')))
+            break;
+    }
+    if(kind > Rqueue)
+        return Rnone;
+
+    for(s = extension + n; *s; s = e) {
+        while(*s == ' ')
+            s++;
+        if(!strncmp(s, "bytes=", 6))
+            limit = &log->bytes;
+        else if(!strncmp(s, "ticks=", 6))
+            limit = &log->ticks;
+        else if(*s == '\0')
+            break;
+        else
+            return Rnone;
+
+        *limit = strtoull(s + 6, &e, 10);
+        if(e == s + 6 || (*e != ' ' && *e != '\0'))
+            return Rnone;
+    }
+
+    /* a queue finds where its messages start from the ticks' marks */
+    if(kind == Rqueue && !log->ticks)
+        log->ticks = QUEUE_TICKS;
+
+    return kind;
+}
+
+static Npfile *syncfs_create(Npfile *dir, char *name, u32 perm, Npuser *uid,
+                             Npgroup *gid, char *extension) {
+    int kind;
+    LogLimits log;
+    Npfile *file;
+    File *d;
+    Domain *dom;
+    void *ops;
+
+    if(perm & Dmlink) {
+        np_werror(Eperm, EPERM);
+        return NULL;
+    }
+
+    kind = Rnone;
+    memset(&log, 0, sizeof(log));
+    if(!(perm & (Dmdir | Dmsymlink | Dmdevice | Dmnamedpipe | Dmsocket)) &&
+       *extension) {
+        kind = kind_parse(extension, &log);
+        if(kind == Rnone || !strcmp(name, "clock")) {
+            np_werror(Ebadtype, EINVAL);
+            return NULL;
+        }
+    }
+
+    /* a clock file makes its directory a clock domain, starting at the
+     * period of the domain it was in */
+    d = dir->aux;
+    dom = NULL;
+    if(!(perm & Dmdir) && !strcmp(name, "clock")) {
+        if(dir->dirfirst) {
+            np_werror(Enotempty, ENOTEMPTY);
+            return NULL;
+        }
+
+        dom = domain_alloc(dir, d->dom ? d->dom->period : clkperiod);
+        if(!dom || !domain_start(dom)) {
+            if(dom)
+                domain_free(dom);
+            np_werror(Enomem, ENOMEM);
+            return NULL;
+        }
+        d->dom = dom;
+    }
+
+    if(perm & Dmdir)
+        ops = &dirops;
+    else
+        ops = &fileops;
+
+    file = syncfs_mknode(dir, name, perm, uid, gid, extension, ops);
+    ((File *) file->aux)->kind = kind;
+    ((File *) file->aux)->log = log;
+    npfile_incref(file);
+
+    /* participants only write, since opening the file is what joins */
+    if(dom) {
+        dom->clkfile = file;
+        dom->partfile = syncfs_mknode(dir, "participants", 0222, uid, gid, "",
+                                      &participantops);
+        dom->changesfile = syncfs_mknode(dir, "changes", 0444, uid, gid, "",
+                                         &changesops);
+        domain_run(dom);
+    }
+
+    return file;
+}
+
+static Npfile *syncfs_first(Npfile *dir) {
+    npfile_incref(dir->dirfirst);
+    return dir->dirfirst;
+}
+
+static Npfile *syncfs_next(Npfile *dir, Npfile *prevchild) {
+    npfile_incref(prevchild->next);
+    return prevchild->next;
+}
+
+static int syncfs_remove(Npfile *dir, Npfile *file) {
+    int i;
+    File *f;
+    ReqList rl;
+
+    /* clock domains are for good, and .snapshot and .batch are not in any
+     * directory */
+    f = file->aux;
+    if(file == snapfile || file == batchfile ||
+       (f->dom && (file == f->dom->clkfile || file == f->dom->partfile ||
+                   file == f->dom->changesfile))) {
+        np_werror(Eperm, EPERM);
+        return 0;
+    }
+
+    if(dir->dirfirst == file)
+        dir->dirfirst = file->next;
+    else
+        file->prev->next = file->next;
+
+    if(file->next)
+        file->next->prev = file->prev;
+
+    if(file == dir->dirlast)
+        dir->dirlast = file->prev;
+
+    file->prev = NULL;
+    file->next = NULL;
+    file->parent = NULL;
+
+    /* nothing will be committed to the file again */
+    pthread_mutex_lock(&f->wlock);
+    rl = f->watchers;
+    f->watchers.reqs = NULL;
+    f->watchers.count = 0;
+    f->watchers.size = 0;
+    pthread_mutex_unlock(&f->wlock);
+
+    for(i = 0; i < rl.count; i++)
+        if(rl.reqs[i])
+            np_respond_error(rl.reqs[i], Enotfound, ENOENT);
+    free(rl.reqs);
+
+    return 1;
+}
+
+static u64 clock_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* List a committed file in the slice's part of the changes.  Called with
+ * file->lock held. */
+static void changes_add(CommitWorker *cw, Npfile *file) {
+    int n, size;
+    char *text;
+
+    for(;;) {
+        n = snprintf(cw->text ? cw->text + cw->textlen : NULL,
+                     cw->textsize - cw->textlen, "%llu %s\n",
+                     (unsigned long long) file->qid.path, file->name);
+        if(cw->textlen + n < cw->textsize)
+            break;
+
+        size = cw->textsize ? cw->textsize * 2 : 4096;
+        while(size <= cw->textlen + n)
+            size *= 2;
+        text = realloc(cw->text, size);
+        if(!text) {
+            cw->textlost = 1;
+            return;
+        }
+        cw->text = text;
+        cw->textsize = size;
+    }
+
+    cw->textlen += n;
+    cw->nchanged++;
+}
+
+/* Put together what the slices listed as the changes of the tick */
+static void changes_commit(Domain *d, int n, int listed) {
+    int i, len, count, lost;
+    char *text;
+    u64 tick;
+    Changes *c;
+    CommitWorker *cw;
+
+    tick = d->committed_tick;
+    text = NULL;
+    len = 0;
+    lost = 0;
+    if(listed) {
+        count = 0;
+        for(i = 0; i < n; i++) {
+            len += d->workers[i].textlen;
+            count += d->workers[i].nchanged;
+            lost |= d->workers[i].textlost;
+        }
+
+        text = lost ? NULL : malloc(len + 48);
+        if(text) {
+            len = sprintf(text, "%llu %d\n", (unsigned long long) tick, count);
+            for(i = 0; i < n; i++) {
+                cw = &d->workers[i];
+                memcpy(text + len, cw->text, cw->textlen);
+                len += cw->textlen;
+            }
+        } else
+            lost = 1;
+
+        for(i = 0; i < n; i++) {
+            cw = &d->workers[i];
+            cw->textlen = 0;
+            cw->nchanged = 0;
+            cw->textlost = 0;
+        }
+    }
+
+    pthread_mutex_lock(&d->changes_lock);
+    c = &d->changes[tick % CHANGES_HISTORY];
+    free(c->text);
+    c->tick = tick;
+    c->text = text;
+    c->len = len;
+    c->lost = lost;
+    d->changes_tick = tick;
+    pthread_mutex_unlock(&d->changes_lock);
+}
+
+static void syncfs_commit_slice(CommitWorker *cw) {
+    int i;
+    u64 length;
+    Npfile *file;
+    File *f;
+    FileRev *fr;
+
+    for(i = cw->start; i < cw->end; i++) {
+        file = cw->fc->files[i];
+        f = file->aux;
+
+        pthread_mutex_lock(&f->wlock);
+        fr = f->fr_write;
+        if(fr) {
+            fr->tick = cw->tick;
+            fr->prev = f->fr_read;
+            if(histdepth)
+                filerev_trim(fr, &cw->retired);
+            else
+                filerev_retire(f->fr_read, &cw->retired);
+            /* fr must be complete before readers can find it */
+            __sync_synchronize();
+            f->fr_read = fr;
+            f->fr_write = NULL;
+            f->accum = 0;
+            length = fr->base + fr->length;
+
+            /* woken once the tick is out */
+            if(f->watchers.count)
+                reqlist_move(&cw->woken, &f->watchers);
+        }
+        pthread_mutex_unlock(&f->wlock);
+
+        /* wstat holds file->lock while it takes f->wlock, so this has to
+         * wait until the revision is published */
+        if(fr) {
+            pthread_mutex_lock(&file->lock);
+            file->length = length;
+            file->mtime = cw->now;
+            if(cw->changes)
+                changes_add(cw, file);
+            pthread_mutex_unlock(&file->lock);
+        }
+
+        npfile_decref(file);
+    }
+}
+
+/* Run a slice off the commit queue and tell its tick thread */
+static void syncfs_commit_run(CommitWorker *cw) {
+    Domain *d;
+
+    d = cw->dom;
+    syncfs_commit_slice(cw);
+
+    pthread_mutex_lock(&d->commit_lock);
+    if(--d->commitpending == 0)
+        pthread_cond_signal(&d->commit_done_cond);
+    pthread_mutex_unlock(&d->commit_lock);
+}
+
+static void *syncfs_commit_proc(void *a) {
+    CommitWorker *cw;
+
+    pthread_mutex_lock(&commitq_lock);
+    for(;;) {
+        while(!commitq_first)
+            pthread_cond_wait(&commitq_cond, &commitq_lock);
+
+        cw = commitq_first;
+        commitq_first = cw->next;
+        if(!commitq_first)
+            commitq_last = NULL;
+        pthread_mutex_unlock(&commitq_lock);
+
+        syncfs_commit_run(cw);
+
+        pthread_mutex_lock(&commitq_lock);
+    }
+
+    return NULL;
+}
+
+/* Take a slice of the domain back off the commit queue, or NULL if the
+ * workers have them all */
+static CommitWorker *commitq_take(Domain *d) {
+    CommitWorker *cw, *prev;
+
+    pthread_mutex_lock(&commitq_lock);
+    prev = NULL;
+    for(cw = commitq_first; cw; prev = cw, cw = cw->next)
+        if(cw->dom == d) {
+            if(prev)
+                prev->next = cw->next;
+            else
+                commitq_first = cw->next;
+            if(commitq_last == cw)
+                commitq_last = prev;
+            break;
+        }
+    pthread_mutex_unlock(&commitq_lock);
+
+    return cw;
+}
+
+static void syncfs_commit(Domain *d) {
+    int i, n, slice, listed;
+    u64 start;
+    time_t now;
+    FileCommits *fc;
+    FileRev *fr;
+    CommitWorker *cw;
+
+    start = clock_now();
+    now = time(NULL);
+    listed = d->changes_open != 0;
+
+    pthread_mutex_lock(&d->batch_lock);
+    pthread_mutex_lock(&d->commits_lock);
+    fc = d->commits_cur;
+    if(fc == &d->commits[0])
+        d->commits_cur = &d->commits[1];
+    else
+        d->commits_cur = &d->commits[0];
+    d->commits_tick++;
+    pthread_mutex_unlock(&d->commits_lock);
+
+    n = fc->count / COMMIT_MINSLICE;
+    if(n > ncommitworkers)
+        n = ncommitworkers;
+    if(n < 1)
+        n = 1;
+
+    slice = (fc->count + n - 1) / n;
+    for(i = 0; i < n; i++) {
+        cw = &d->workers[i];
+        cw->fc = fc;
+        cw->start = i * slice < fc->count ? i * slice : fc->count;
+        cw->end = (i + 1) * slice < fc->count ? (i + 1) * slice : fc->count;
+        cw->tick = d->committed_tick + 1;
+        cw->now = now;
+        cw->changes = listed;
+    }
+
+    if(n > 1) {
+        d->commitpending = n - 1;
+        pthread_mutex_lock(&commitq_lock);
+        for(i = 1; i < n; i++) {
+            cw = &d->workers[i];
+            cw->next = NULL;
+            if(commitq_last)
+                commitq_last->next = cw;
+            else
+                commitq_first = cw;
+            commitq_last = cw;
+        }
+        pthread_cond_broadcast(&commitq_cond);
+        pthread_mutex_unlock(&commitq_lock);
+    }
+
+    syncfs_commit_slice(&d->workers[0]);
+
+    /* the workers may be busy with other domains, so run what they have
+     * not got to yet */
+    if(n > 1) {
+        while((cw = commitq_take(d)) != NULL)
+            syncfs_commit_run(cw);
+
+        pthread_mutex_lock(&d->commit_lock);
+        while(d->commitpending)
+            pthread_cond_wait(&d->commit_done_cond, &d->commit_lock);
+        pthread_mutex_unlock(&d->commit_lock);
+    }
+    pthread_mutex_unlock(&d->batch_lock);
+
+    /* every slice is in, so the tick can be seen */
+    __sync_synchronize();
+    d->committed_tick++;
+
+    changes_commit(d, n, listed);
+
+    /* watchers of what was committed are answered with the clock waiters */
+    for(i = 0; i < n; i++)
+        if(d->workers[i].woken.count) {
+            pthread_mutex_lock(&d->waiters_lock);
+            reqlist_move(&d->waiters, &d->workers[i].woken);
+            pthread_mutex_unlock(&d->waiters_lock);
+        }
+
+    /* hand on what the slices replaced, in no particular order */
+    for(i = 0; i < n; i++) {
+        fr = d->workers[i].retired;
+        if(fr) {
+            while(fr->next)
+                fr = fr->next;
+            fr->next = d->retiring;
+            d->retiring = d->workers[i].retired;
+            d->workers[i].retired = NULL;
+        }
+    }
+
+    d->stats.commitfiles = fc->count;
+    d->stats.lastcommit = clock_now() - start;
+    if(d->stats.lastcommit > d->stats.maxcommit)
+        d->stats.maxcommit = d->stats.lastcommit;
+
+    fc->count = 0;
+}
+
+/* Replace the contents of a file the tick thread keeps up to date */
+static void file_publish(Npfile *file, char *str, int len) {
+    File *f;
+    FileRev *fr;
+
+    f = file->aux;
+    fr = filerev_alloc();
+    if(!fr)
+        return;
+
+    if(filerev_write(fr, 0, len, (u8 *) str) != len) {
+        filerev_unref(fr);
+        return;
+    }
+
+    pthread_mutex_lock(&f->wlock);
+    if(f->fr_write)
+        filerev_unref(f->fr_write);
+    f->fr_write = fr;
+    pthread_mutex_unlock(&f->wlock);
+
+    filecommits_add(file, 0);
+}
+
+static Npfcall *file_rstat(Npfile *file, int dotu) {
+    Npwstat wstat;
+
+    pthread_mutex_lock(&file->lock);
+    wstat.size = 0;
+    wstat.type = 0;
+    wstat.dev = 0;
+    wstat.qid = file->qid;
+    wstat.mode = file->mode;
+    wstat.atime = file->atime;
+    wstat.mtime = file->mtime;
+    wstat.length = file->length;
+    wstat.name = file->name;
+    wstat.uid = file->uid->uname;
+    wstat.gid = file->gid->gname;
+    wstat.muid = file->muid->uname;
+    wstat.extension = file->extension;
+    wstat.n_uid = file->uid->uid;
+    wstat.n_gid = file->gid->gid;
+    wstat.n_muid = file->muid->uid;
+    pthread_mutex_unlock(&file->lock);
+
+    return np_create_rstat(&wstat, dotu);
+}
+
+static Npfcall *syncfs_stat(Npfid *fid, Npreq *req) {
+    int ret;
+    Npfilefid *f;
+    Npfile *file;
+    Domain *d;
+
+    f = fid->aux;
+    file = f->file;
+    d = ((File *) file->aux)->dom;
+
+    if(d && file == d->clkfile) {
+        pthread_mutex_lock(&d->waiters_lock);
+        ret = reqlist_push(&d->waiters, req);
+        pthread_mutex_unlock(&d->waiters_lock);
+
+        if(ret)
+            np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    return file_rstat(file, fid->conn->dotu);
+}
+
+/* Walk from a directory to .snapshot or .batch, which is ctl.  The fid
+ * keeps the reference it had to the directory. */
+static int ctl_walk(Npfilefid *f, Npfile *ctl, Npqid *wqid) {
+    FileFid *w;
+
+    w = calloc(1, sizeof(FileFid));
+    if(!w) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
+    }
+
+    np_werror(NULL, 0);
+    w->dir = f->file;
+    npfile_incref(ctl);
+    f->file = ctl;
+    f->aux = w;
+    *wqid = ctl->qid;
+
+    return 1;
+}
+
+/* A walk to name@tick, when there is no file by that name, is a walk to the
+ * data file name with the fid pinned to tick */
+static int syncfs_walk(Npfid *fid, Npstr *wname, Npqid *wqid) {
+    int i, j;
+    u64 tick;
+    Npstr name;
+    Npfilefid *f;
+    FileFid *w;
+
+    /* a pin belongs to the file it was walked to */
+    f = fid->aux;
+    if(f->omode == ~0 && f->aux) {
+        filefid_free(f->aux);
+        f->aux = NULL;
+    }
+
+    if(npfile_walk(fid, wname, wqid))
+        return 1;
+
+    if(f->file->mode & Dmdir && wname->len == 9 &&
+       !memcmp(wname->str, ".snapshot", 9))
+        return ctl_walk(f, snapfile, wqid);
+    if(f->file->mode & Dmdir && wname->len == 6 &&
+       !memcmp(wname->str, ".batch", 6))
+        return ctl_walk(f, batchfile, wqid);
+
+    for(i = wname->len - 1; i > 0 && isdigit(wname->str[i]); i--)
+        ;
+    if(i == 0 || i == wname->len - 1 || wname->str[i] != '@')
+        return 0;
+
+    /* wname is not terminated */
+    tick = 0;
+    for(j = i + 1; j < wname->len; j++)
+        tick = tick * 10 + wname->str[j] - '0';
+    if(tick == 0)
+        return 0;
+
+    np_werror(NULL, 0);
+    name.str = wname->str;
+    name.len = i;
+    if(!npfile_walk(fid, &name, wqid))
+        return 0;
+
+    if(f->file->ops != &fileops) {
+        np_werror(Enotfound, ENOENT);
+        return 0;
+    }
 
-        oldname = file->name;
-        file->name = sname;
+    w = calloc(1, sizeof(FileFid));
+    if(!w) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
     }
+    w->tick = tick;
+    f->aux = w;
 
-    if(stat->length != (u64) ~0) {
-        oldlength = fr->length;
-        length = stat->length;
-        if(filerev_truncate(fr, length)) {
-            np_werror(Enospace, ENOSPC);
-            goto error;
-        }
+    return 1;
+}
 
-        if(length > fr->datasize)
-            length = fr->datasize;
+/* A fid pinned to a tick only reads the file as it was then, so nothing that
+ * would change the live file gets past these to npfile */
+static int fid_pinned(Npfid *fid) {
+    Npfilefid *f;
 
-        if(fr->length < length)
-            memset(fr->data + fr->length, 0,
-                   length - fr->length);
+    f = fid->aux;
+    return f->file->ops == &fileops && f->aux && ((FileFid *) f->aux)->tick;
+}
 
-        fr->length = length;
+static Npfcall *syncfs_fidopen(Npfid *fid, u8 mode) {
+    if(fid_pinned(fid) && ((mode & 3) == Owrite || (mode & 3) == Ordwr ||
+                           mode & (Otrunc | Orclose))) {
+        np_werror(Eperm, EPERM);
+        return NULL;
     }
 
-    if(stat->mode != (u32) ~0) {
-        oldperm = file->mode;
-        file->mode = stat->mode;
+    return npfile_open(fid, mode);
+}
+
+static Npfcall *syncfs_fidwstat(Npfid *fid, Npstat *stat) {
+    if(fid_pinned(fid)) {
+        np_werror(Eperm, EPERM);
+        return NULL;
     }
 
-    if(stat->mtime != (u32) ~0) {
-        oldmtime = file->mtime;
-        file->mtime = stat->mtime;
+    return npfile_wstat(fid, stat);
+}
+
+static Npfcall *syncfs_fidremove(Npfid *fid) {
+    if(fid_pinned(fid)) {
+        np_werror(Eperm, EPERM);
+        return NULL;
     }
 
-    free(oldname);
-    if(lockparent)
-        pthread_mutex_unlock(&file->parent->lock);
+    return npfile_remove(fid);
+}
 
-    if(stat->length != (u64) ~0) {
-        pthread_mutex_lock(&f->wlock);
-        if(f->fr_write)
-            filerev_unref(f->fr_write);
-        f->fr_write = fr;
-        pthread_mutex_unlock(&f->wlock);
+static int syncfs_clone(Npfid *fid, Npfid *newfid) {
+    Npfilefid *f, *nf;
+    FileFid *w;
+
+    if(!npfile_clone(fid, newfid))
+        return 0;
 
-        filecommits_add(file);
+    f = fid->aux;
+    if(f->omode == ~0 && f->aux) {
+        w = calloc(1, sizeof(FileFid));
+        if(!w) {
+            np_werror(Enomem, ENOMEM);
+            return 0;
+        }
+        w->tick = ((FileFid *) f->aux)->tick;
+        w->dir = ((FileFid *) f->aux)->dir;
+        if(w->dir)
+            npfile_incref(w->dir);
+        nf = newfid->aux;
+        nf->aux = w;
     }
 
     return 1;
+}
 
-error:
-    if(oldname) {
-        free(file->name);
-        file->name = oldname;
+/* closefid only runs for fids that were opened */
+static void syncfs_fiddestroy(Npfid *fid) {
+    Npfilefid *f;
+
+    f = fid->aux;
+    if(f && f->omode == ~0 && f->aux) {
+        filefid_free(f->aux);
+        f->aux = NULL;
     }
 
-    if(oldperm != ~0)
-        file->mode = oldperm;
+    npfile_fiddestroy(fid);
+}
 
-    if(oldmtime != ~0)
-        file->mtime = oldmtime;
+static void syncfs_flush(Npreq *req) {
+    int found;
+    Npfilefid *fid;
+    File *f;
+    Domain *d;
+
+    found = 0;
+    if(req->tcall && req->tcall->type == Tread && req->fid) {
+        fid = req->fid->aux;
+        if(fid && !(fid->file->mode & Dmdir)) {
+            f = fid->file->aux;
+            pthread_mutex_lock(&f->wlock);
+            found = reqlist_clear(&f->watchers, 0, req);
+            pthread_mutex_unlock(&f->wlock);
+        }
+    }
 
-    if(oldlength != ~0)
-        filerev_unref(fr);
+    pthread_mutex_lock(&domains_lock);
+    for(d = domains; d && !found; d = d->next) {
+        pthread_mutex_lock(&d->waiters_lock);
+        found = reqlist_clear(&d->waiters, d->waiters_next, req);
+        pthread_mutex_unlock(&d->waiters_lock);
+    }
+    pthread_mutex_unlock(&domains_lock);
 
-    if(lockparent)
-        pthread_mutex_unlock(&file->parent->lock);
+    if(found)
+        np_respond(req, NULL);
+}
 
-    return 0;
+/* Put the domain on the release queue, under its waiters_lock */
+static void releaseq_add(Domain *d) {
+    pthread_mutex_lock(&releaseq_lock);
+    d->releasing = 1;
+    d->releasenext = NULL;
+    if(releaseq_last)
+        releaseq_last->releasenext = d;
+    else
+        releaseq_first = d;
+    releaseq_last = d;
+    pthread_cond_signal(&releaseq_cond);
+    pthread_mutex_unlock(&releaseq_lock);
 }
 
-static void syncfs_destroy(Npfile *file) {
-    File *f;
+/* Called by the tick thread: one wakeup no matter how many are waiting */
+static void syncfs_release_clockwaiters(Domain *d) {
+    pthread_mutex_lock(&d->waiters_lock);
+    if(d->waiters_released != d->waiters.count) {
+        d->waiters_released = d->waiters.count;
+        if(!d->releasing)
+            releaseq_add(d);
+    }
+    pthread_mutex_unlock(&d->waiters_lock);
+}
 
-    f = file->aux;
-    pthread_mutex_lock(&f->wlock);
-    pthread_mutex_lock(&f->lock);
-    filerev_unref(f->fr_read);
-    f->fr_read = NULL;
-    if(f->fr_write) {
-        filerev_unref(f->fr_write);
-        f->fr_write = NULL;
+static int changes_open(Npfilefid *fid) {
+    ChangesCursor *cur;
+    Domain *d;
+
+    cur = calloc(1, sizeof(ChangesCursor));
+    if(!cur) {
+        np_werror(Enomem, ENOMEM);
+        return 0;
     }
-    pthread_mutex_unlock(&f->lock);
-    pthread_mutex_unlock(&f->wlock);
-    free(f);
+
+    d = ((File *) fid->file->aux)->dom;
+    __sync_fetch_and_add(&d->changes_open, 1);
+    fid->aux = cur;
+    return 1;
 }
 
-static Npfile *syncfs_create(Npfile *dir, char *name, u32 perm, Npuser *uid,
-                             Npgroup *gid, char *extension) {
-    Npfile *file;
-    File *d, *f;
-    void *ops;
+static void changes_close(Npfilefid *fid) {
+    Domain *d;
 
-    if(perm & Dmlink) {
-        np_werror(Eperm, EPERM);
-        return NULL;
+    if(!fid->aux)
+        return;
+
+    d = ((File *) fid->file->aux)->dom;
+    __sync_fetch_and_sub(&d->changes_open, 1);
+    free(fid->aux);
+    fid->aux = NULL;
+}
+
+/* Returns NULL with no error when the tick is still to come and the request
+ * has been parked with the clock waiters */
+static Npfcall *changes_readv(Npfilefid *fid, u64 offset, u32 count,
+                              Npreq *req) {
+    int ret, n;
+    ChangesCursor *cur;
+    Changes *c;
+    Domain *d;
+    Npfcall *rc;
+
+    d = ((File *) fid->file->aux)->dom;
+    cur = fid->aux;
+
+    pthread_mutex_lock(&d->changes_lock);
+    if(offset && offset != cur->tick) {
+        cur->tick = offset;
+        cur->pos = 0;
+    } else if(!offset && (!cur->tick || cur->pos < 0)) {
+        /* on to the next tick once the last one has been read */
+        cur->tick = cur->tick ? cur->tick + 1 : d->changes_tick + 1;
+        cur->pos = 0;
     }
 
-    d = dir->aux;
-    f = file_alloc();
-    if(perm & Dmdir)
-        ops = &dirops;
-    else
-        ops = &fileops;
+    for(;;) {
+        if(cur->tick > d->changes_tick) {
+            pthread_mutex_unlock(&d->changes_lock);
 
-    file = npfile_alloc(dir, name, perm, qidpath++, ops, f);
-    file->uid = uid;
-    file->gid = gid;
-    file->muid = uid;
-    npfile_incref(file);
-    npfile_incref(file);
+            pthread_mutex_lock(&d->waiters_lock);
+            ret = reqlist_push(&d->waiters, req);
+            pthread_mutex_unlock(&d->waiters_lock);
 
-    if(dir->dirlast) {
-        dir->dirlast->next = file;
-        file->prev = dir->dirlast;
-    } else
-        dir->dirfirst = file;
+            if(ret)
+                np_werror(Enomem, ENOMEM);
+            return NULL;
+        }
 
-    dir->dirlast = file;
-    file->extension = strdup(extension);
+        c = &d->changes[cur->tick % CHANGES_HISTORY];
+        if(c->tick == cur->tick && c->text)
+            break;
 
-    return file;
-}
+        /* a reader just following along can skip what was not listed, but
+         * not a list that was lost; it hears of that once and goes on */
+        if(c->tick == cur->tick && c->lost) {
+            if(!offset)
+                cur->pos = -1;
+            pthread_mutex_unlock(&d->changes_lock);
+            np_werror(Echangeslost, EIO);
+            return NULL;
+        }
+        if(offset || cur->tick + CHANGES_HISTORY <= d->changes_tick) {
+            pthread_mutex_unlock(&d->changes_lock);
+            np_werror(Echangeslost, EIO);
+            return NULL;
+        }
+        cur->tick++;
+    }
 
-static Npfile *syncfs_first(Npfile *dir) {
-    npfile_incref(dir->dirfirst);
-    return dir->dirfirst;
-}
+    /* whole lines only, unless a line does not fit on its own */
+    n = cur->pos < 0 ? 0 : c->len - cur->pos;
+    if(n > count) {
+        for(n = count; n > 0 && c->text[cur->pos + n - 1] != '\n'; n--)
+            ;
+        if(n == 0)
+            n = count;
+    }
 
-static Npfile *syncfs_next(Npfile *dir, Npfile *prevchild) {
-    npfile_incref(prevchild->next);
-    return prevchild->next;
+    rc = np_alloc_rread(n);
+    if(!rc) {
+        pthread_mutex_unlock(&d->changes_lock);
+        np_werror(Enomem, ENOMEM);
+        return NULL;
+    }
+
+    if(n) {
+        memcpy(rc->data, c->text + cur->pos, n);
+        cur->pos += n;
+    } else
+        cur->pos = -1;
+    pthread_mutex_unlock(&d->changes_lock);
+
+    np_set_rread_count(rc, n);
+    return rc;
 }
 
-static int syncfs_remove(Npfile *dir, Npfile *file) {
-    if(dir->dirfirst == file)
-        dir->dirfirst = file->next;
+/* Answer a request parked until a tick: a Tstat of the clock, or a read that
+ * was watching a file or waiting for its tick in the changes file */
+static void syncfs_answer(Domain *d, Npreq *req) {
+    int ecode;
+    char *ename;
+    Npfcall *rc;
+    Npfilefid *fid;
+
+    if(req->tcall->type != Tread) {
+        np_respond(req, file_rstat(d->clkfile, req->conn->dotu));
+        return;
+    }
+
+    fid = req->fid->aux;
+    if(fid->file == d->changesfile)
+        rc = changes_readv(fid, req->tcall->offset, req->tcall->count, req);
+    else if(((File *) fid->file->aux)->kind == Rqueue)
+        rc = queue_read(fid, req->tcall->count, req);
     else
-        file->prev->next = file->next;
+        rc = watch_read(fid, req->tcall->offset, req->tcall->count, req);
+    if(np_haserror()) {
+        np_rerror(&ename, &ecode);
+        np_respond_error(req, ename, ecode);
+        np_werror(NULL, 0);
+    } else if(rc)
+        np_respond(req, rc);
+}
 
-    if(file->next)
-        file->next->prev = file->prev;
+/* Claims a batch of a queued domain's waiters at a time, queueing the
+ * domain again for another thread if there are more */
+static void *syncfs_release_proc(void *a) {
+    int i, n;
+    Npreq *req, *reqs[RELEASE_BATCH];
+    ReqList *rl;
+    Domain *d;
 
-    if(file == dir->dirlast)
-        dir->dirlast = file->prev;
+    for(;;) {
+        pthread_mutex_lock(&releaseq_lock);
+        while(!releaseq_first)
+            pthread_cond_wait(&releaseq_cond, &releaseq_lock);
+        d = releaseq_first;
+        releaseq_first = d->releasenext;
+        if(!releaseq_first)
+            releaseq_last = NULL;
+        pthread_mutex_unlock(&releaseq_lock);
+
+        rl = &d->waiters;
+        pthread_mutex_lock(&d->waiters_lock);
+        n = 0;
+        while(n < RELEASE_BATCH && d->waiters_next < d->waiters_released) {
+            req = rl->reqs[d->waiters_next++];
+            if(req)
+                reqs[n++] = req;
+        }
 
-    file->prev = NULL;
-    file->next = NULL;
-    file->parent = NULL;
+        /* everything released has been claimed; drop it from the list */
+        if(d->waiters_next == d->waiters_released) {
+            rl->count -= d->waiters_released;
+            memmove(rl->reqs, rl->reqs + d->waiters_released,
+                    rl->count * sizeof(Npreq *));
+            d->waiters_next = 0;
+            d->waiters_released = 0;
+            d->releasing = 0;
+        } else
+            releaseq_add(d);
+        pthread_mutex_unlock(&d->waiters_lock);
 
-    return 1;
+        for(i = 0; i < n; i++)
+            syncfs_answer(d, reqs[i]);
+    }
+
+    return NULL;
 }
 
-static void syncfs_commit(void) {
-    time_t now;
+/* Create one of the files the server provides in the root directory */
+static Npfile *syncfs_mkfile(Npuser *user, char *name, u32 perm) {
+    Npfid fid;
+    Npfilefid f;
 
-    now = time(NULL);
+    memset(&f, 0, sizeof(f));
+    f.fid = &fid;
+    f.file = root;
+    fid.aux = &f;
+    fid.user = user;
+    npfile_create(&fid, npstr_of_str(name), perm, 0, npstr_of_str(""));
 
-    pthread_mutex_lock(&filecommits_lock);
+    return npfile_find(root, name);
+}
 
-    Npfile *file;
-    while((file = filecommits_pop()) != NULL) {
-        File *f = file->aux;
+/* Sleep until the deadline, spinning through the last tickspin ns of it
+ * since waking from a sleep is rarely that precise.  Returns the time we
+ * actually woke at. */
+static u64 tick_wait(u64 deadline) {
+    u64 now;
+    struct timespec ts;
+
+    now = clock_now();
+    if(now + tickspin < deadline) {
+        ts.tv_sec = (deadline - tickspin) / 1000000000;
+        ts.tv_nsec = (deadline - tickspin) % 1000000000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+              EINTR)
+            ;
+        now = clock_now();
+    }
 
-        pthread_mutex_lock(&f->wlock);
-        if(f->fr_write) {
-            pthread_mutex_lock(&f->lock);
+    while(now < deadline)
+        now = clock_now();
 
-            FileRev *fr = f->fr_read;
-            f->fr_read = f->fr_write;
-            f->fr_write = NULL;
-            filerev_unref(fr);
+    return now;
+}
 
-            pthread_mutex_lock(&file->lock);
-            file->length = f->fr_read->length;
-            file->mtime = now;
-            pthread_mutex_unlock(&file->lock);
+static int tick_stats(TickStats *ts, char *buf, int len) {
+    u64 late;
+
+    late = ts->count - ts->early;
+    return snprintf(buf, len, "\"ticks\":{\"count\":%llu,\"overruns\":%llu,"
+                    "\"skipped\":%llu,\"barrier\":{\"early\":%llu,"
+                    "\"timeout\":%llu},\"jitter\":{\"last\":%llu,"
+                    "\"max\":%llu,\"mean\":%llu},\"commit\":{\"files\":%llu,"
+                    "\"last\":%llu,\"max\":%llu}}",
+                    (unsigned long long) ts->count,
+                    (unsigned long long) ts->overruns,
+                    (unsigned long long) ts->skipped,
+                    (unsigned long long) ts->early,
+                    (unsigned long long) ts->timeouts,
+                    (unsigned long long) ts->lastjitter,
+                    (unsigned long long) ts->maxjitter,
+                    (unsigned long long) (late ? ts->sumjitter / late : 0),
+                    (unsigned long long) ts->commitfiles,
+                    (unsigned long long) ts->lastcommit,
+                    (unsigned long long) ts->maxcommit);
+}
 
-            pthread_mutex_unlock(&f->lock);
+/* The path of a domain's directory, one name at a time under the lock
+ * that renaming it takes */
+static int domain_path(Domain *d, char *buf, int len) {
+    int n, m;
+    Npfile *dir, *parent;
+
+    n = len - 1;
+    buf[n] = '\0';
+    for(dir = d->dir; dir != root && n > 0; dir = parent) {
+        parent = dir->parent;
+        pthread_mutex_lock(&parent->lock);
+        m = strlen(dir->name);
+        if(m + 1 > n) {
+            pthread_mutex_unlock(&parent->lock);
+            break;
         }
-        pthread_mutex_unlock(&f->wlock);
+        n -= m;
+        memcpy(buf + n, dir->name, m);
+        buf[--n] = '/';
+        pthread_mutex_unlock(&parent->lock);
     }
 
-    pthread_mutex_unlock(&filecommits_lock);
+    if(n == len - 1)
+        buf[--n] = '/';
+    memmove(buf, buf + n, len - n);
+    return len - 1 - n;
 }
 
-static Npfcall *syncfs_stat(Npfid *fid) {
-    Npfilefid *f;
-    Npfile *file;
-    Npwstat wstat;
+/* Everything the stats file reports, as one JSON object.  The root domain's
+ * ticks are at the top, the others are listed under domains. */
+static int syncfs_stats(char *buf, int len) {
+    int n, first;
+    char path[256];
+    Domain *d;
+
+    n = snprintf(buf, len, "{");
+    if(n < len)
+        n += slab_stats(buf + n, len - n);
+    if(n < len)
+        n += snprintf(buf + n, len - n, ",");
+    if(n < len)
+        n += tick_stats(&rootdom->stats, buf + n, len - n);
+    if(n < len)
+        n += snprintf(buf + n, len - n, ",\"domains\":[");
+
+    first = 1;
+    pthread_mutex_lock(&domains_lock);
+    for(d = domains; d && n < len; d = d->next) {
+        if(d == rootdom)
+            continue;
+
+        domain_path(d, path, sizeof(path));
+        n += snprintf(buf + n, len - n, "%s{\"dir\":\"%s\",\"period\":%ld,",
+                      first ? "" : ",", path, d->period);
+        if(n < len)
+            n += tick_stats(&d->stats, buf + n, len - n);
+        if(n < len)
+            n += snprintf(buf + n, len - n, "}");
+        first = 0;
+    }
+    pthread_mutex_unlock(&domains_lock);
 
-    f = fid->aux;
-    file = f->file;
+    if(n < len)
+        n += snprintf(buf + n, len - n, "]}\n");
 
-    if(file == clkfile) {
-        LockList *locklist = malloc(sizeof(LockList));
-        pthread_mutex_init(&locklist->lock, NULL);
-        pthread_cond_init(&locklist->cond, NULL);
+    return n < len ? n : len - 1;
+}
 
-        pthread_mutex_lock(&locklist->lock);
+/* Wait for the next tick of a domain, which is at the deadline unless all of
+ * its participants arrive first.  Arrivals after this count towards the
+ * tick after, since their writes may not make this one.  Returns the time
+ * we woke at. */
+static u64 domain_wait(Domain *d, u64 deadline, int *early) {
+    u64 wake;
+    struct timespec ts;
 
-        pthread_mutex_lock(&clockstaters_lock);
-        locklist->next = clockstaters;
-        clockstaters = locklist;
-        pthread_mutex_unlock(&clockstaters_lock);
+    wake = deadline - tickspin;
+    ts.tv_sec = wake / 1000000000;
+    ts.tv_nsec = wake % 1000000000;
 
-        pthread_cond_wait(&locklist->cond, &locklist->lock);
+    pthread_mutex_lock(&d->barrier_lock);
+    for(;;) {
+        *early = d->nparticipants && d->narrived == d->nparticipants;
+        if(*early || clock_now() >= wake)
+            break;
+        pthread_cond_timedwait(&d->barrier_cond, &d->barrier_lock, &ts);
+    }
+    if(!*early && d->nparticipants)
+        d->stats.timeouts++;
+    d->narrived = 0;
+    d->barriergen++;
+    pthread_mutex_unlock(&d->barrier_lock);
 
-        pthread_mutex_unlock(&locklist->lock);
+    return *early ? clock_now() : tick_wait(deadline);
+}
 
-        pthread_cond_destroy(&locklist->cond);
-        pthread_mutex_destroy(&locklist->lock);
-        free(locklist);
-    }
+/* Tick a domain for ever.  The root domain is ticked by main and also keeps
+ * the stats file up to date. */
+static void domain_tick(Domain *d) {
+    int early;
+    u64 now, clkval, deadline, missed;
+    long int period;
+    TickStats *ts;
+    char clkstr[96], statstr[8192];
+
+    ts = &d->stats;
+    clkval = 0;
+    deadline = clock_now();
+    for(;;) {
+        now = domain_wait(d, deadline, &early);
+
+        /* an early tick starts the next period from now */
+        ts->count++;
+        if(early) {
+            ts->early++;
+            deadline = now;
+        } else {
+            ts->lastjitter = now - deadline;
+            ts->sumjitter += ts->lastjitter;
+            if(ts->lastjitter > ts->maxjitter)
+                ts->maxjitter = ts->lastjitter;
+        }
 
-    pthread_mutex_lock(&file->lock);
-    wstat.size = 0;
-    wstat.type = 0;
-    wstat.dev = 0;
-    wstat.qid = file->qid;
-    wstat.mode = file->mode;
-    wstat.atime = file->atime;
-    wstat.mtime = file->mtime;
-    wstat.length = file->length;
-    wstat.name = file->name;
-    wstat.uid = file->uid->uname;
-    wstat.gid = file->gid->gname;
-    wstat.muid = file->muid->uname;
-    wstat.extension = file->extension;
-    wstat.n_uid = file->uid->uid;
-    wstat.n_gid = file->gid->gid;
-    wstat.n_muid = file->muid->uid;
-    pthread_mutex_unlock(&file->lock);
+        period = d->period;
+        sprintf(clkstr, "{\"clock\":%ld,\"tick\":%llu,\"interval\":%ld}\n",
+                (long int) clkval,
+                (unsigned long long) d->committed_tick + 1, period);
+        file_publish(d->clkfile, clkstr, strlen(clkstr));
 
-    return np_create_rstat(&wstat, fid->conn->dotu);
-}
+        if(d == rootdom)
+            file_publish(statsfile, statstr,
+                         syncfs_stats(statstr, sizeof(statstr)));
+
+        syncfs_commit(d);
 
-static void syncfs_release_clockstaters(void) {
-    LockList *locklist;
+        syncfs_release_clockwaiters(d);
 
-    pthread_mutex_lock(&clockstaters_lock);
+        filerev_reclaim(d);
 
-    locklist = clockstaters;
-    while(locklist != NULL) {
-        LockList *locklistnext = locklist->next;
-        pthread_mutex_lock(&locklist->lock);
-        pthread_cond_signal(&locklist->cond);
-        pthread_mutex_unlock(&locklist->lock);
-        locklist = locklistnext;
+        /* An overrun either runs the missed ticks as soon as it can, or
+         * drops them and keeps the clock counting whole periods */
+        clkval++;
+        deadline += period;
+        now = clock_now();
+        if(now >= deadline) {
+            ts->overruns++;
+            if(!tickcatchup) {
+                missed = (now - deadline) / period + 1;
+                ts->skipped += missed;
+                clkval += missed;
+                deadline += missed * period;
+            }
+        }
     }
-    clockstaters = NULL;
+}
+
+static void *domain_tick_proc(void *a) {
+    Domain *d;
 
-    pthread_mutex_unlock(&clockstaters_lock);
+    d = a;
+    pthread_mutex_lock(&d->barrier_lock);
+    while(!d->running)
+        pthread_cond_wait(&d->barrier_cond, &d->barrier_lock);
+    pthread_mutex_unlock(&d->barrier_lock);
+
+    domain_tick(d);
+    return NULL;
 }
 
-static int timespec_subtract(struct timespec *result, const struct timespec *x,
-                             struct timespec *y) {
-    if(x->tv_nsec < y->tv_nsec) {
-        int nsec = (y->tv_nsec - x->tv_nsec) / 1000000000 + 1;
-        y->tv_nsec -= 1000000000 * nsec;
-        y->tv_sec += nsec;
-    }
-    if(x->tv_nsec - y->tv_nsec > 1000000000) {
-        int nsec = (x->tv_nsec - y->tv_nsec) / 1000000000;
-        y->tv_nsec += 1000000000 * nsec;
-        y->tv_sec -= nsec;
+/* Start the tick thread, which inherits the priority of whoever made the
+ * domain, held back until domain_run.  The root domain ticks in main.
+ * Returns 0 if there is no thread to be had. */
+static int domain_start(Domain *d) {
+    int i;
+    pthread_t tid;
+
+    for(i = 0; i < ncommitworkers; i++)
+        d->workers[i].dom = d;
+
+    if(d->dir != root) {
+        if(pthread_create(&tid, NULL, domain_tick_proc, d))
+            return 0;
+        pthread_detach(tid);
     }
 
-    result->tv_sec = x->tv_sec - y->tv_sec;
-    result->tv_nsec = x->tv_nsec - y->tv_nsec;
+    return 1;
+}
 
-    return x->tv_sec < y->tv_sec;
+/* Let the tick thread go once the domain's files are in place */
+static void domain_run(Domain *d) {
+    pthread_mutex_lock(&d->barrier_lock);
+    d->running = 1;
+    pthread_cond_broadcast(&d->barrier_cond);
+    pthread_mutex_unlock(&d->barrier_lock);
 }
 
-static void pthread_nanosleep(const struct timespec *req,
-                              struct timespec *rem) {
-    int result;
-    pthread_cond_t timercond = PTHREAD_COND_INITIALIZER;
-    pthread_mutex_t timerlock = PTHREAD_MUTEX_INITIALIZER;
-    struct timespec timerexpires;
+/* The commit workers and release threads every domain shares.  The tick
+ * thread runs the first slice of its own commits, so there is one worker
+ * fewer than slices. */
+static int pools_start(void) {
+    int i;
+    pthread_t tid;
+
+    for(i = 1; i < ncommitworkers; i++) {
+        if(pthread_create(&tid, NULL, syncfs_commit_proc, NULL))
+            return 0;
+        pthread_detach(tid);
+    }
 
-    clock_gettime(CLOCK_REALTIME, &timerexpires);
-    timerexpires.tv_nsec += req->tv_nsec;
-    timerexpires.tv_sec += req->tv_sec;
-    if(timerexpires.tv_nsec >= 1000000000) {
-        int nsec = timerexpires.tv_nsec / 1000000000;
-        timerexpires.tv_nsec -= nsec * 1000000000;
-        timerexpires.tv_sec += nsec;
+    for(i = 0; i < nrthreads; i++) {
+        if(pthread_create(&tid, NULL, syncfs_release_proc, NULL))
+            return 0;
+        pthread_detach(tid);
     }
 
-    pthread_mutex_lock(&timerlock);
-    result = ~ETIMEDOUT;
-    while(result != ETIMEDOUT)
-        result = pthread_cond_timedwait(&timercond, &timerlock, &timerexpires);
-    pthread_mutex_unlock(&timerlock);
+    return 1;
 }
 
 static RETSIGTYPE sigint(int signnum) {
@@ -646,28 +3845,35 @@ static RETSIGTYPE sigint(int signnum) {
 static void
 usage()
 {
-    fprintf(stderr, "syncfs: -n -d -m -w nthreads -b blocksize -p port "
-                    "-c clkperiod\n");
+    fprintf(stderr, "syncfs: -n -d -m -w nthreads -r nthreads -k nthreads "
+                    "-e nthreads -b blocksize "
+                    "-p port -c clkperiod -s spinus -o skip|catchup "
+                    "-H history\n");
     exit(-1);
 }
 
 int
 main(int argc, char **argv)
 {
-    int c, debuglevel, nwthreads, nodetach, port, fd;
+    int c, debuglevel, nwthreads, npollthreads, nodetach, port, fd;
     pid_t pid;
     Npuser *user;
     char *logfile, *s;
 
     nodetach = 0;
     debuglevel = 0;
-    blksize = getpagesize();
+    blksize = sysconf(_SC_PAGESIZE);
     nwthreads = 128;
+    npollthreads = 0;
+    nrthreads = 4;
+    ncommitworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncommitworkers < 1)
+        ncommitworkers = 1;
     port = 10000;
     clkperiod = 100000000;
     logfile = "/tmp/syncfs.log";
     user = np_uname2user("nobody");
-    while ((c = getopt(argc, argv, "ndmw:b:p:l:c:")) != -1) {
+    while ((c = getopt(argc, argv, "ndmw:r:k:e:b:p:l:c:s:o:H:")) != -1) {
         switch (c) {
         case 'n':
             nodetach = 1;
@@ -697,6 +3903,26 @@ main(int argc, char **argv)
                 usage();
             break;
 
+        case 'r':
+            nrthreads = strtol(optarg, &s, 10);
+            if(*s != '\0' || nrthreads < 1)
+                usage();
+            break;
+
+        case 'k':
+            ncommitworkers = strtol(optarg, &s, 10);
+            if(*s != '\0' || ncommitworkers < 1)
+                usage();
+            break;
+
+        /* read connections from this many epoll threads instead of
+         * starting a thread for each */
+        case 'e':
+            npollthreads = strtol(optarg, &s, 10);
+            if(*s != '\0' || npollthreads < 0)
+                usage();
+            break;
+
         case 'p':
             port = strtol(optarg, &s, 10);
             if(*s != '\0')
@@ -705,7 +3931,28 @@ main(int argc, char **argv)
 
         case 'c':
             clkperiod = strtol(optarg, &s, 10) * 1000000;
-            if(*s != '\0')
+            if(*s != '\0' || clkperiod <= 0)
+                usage();
+            break;
+
+        case 's':
+            tickspin = strtol(optarg, &s, 10) * 1000;
+            if(*s != '\0' || tickspin < 0)
+                usage();
+            break;
+
+        case 'o':
+            if(!strcmp(optarg, "catchup"))
+                tickcatchup = 1;
+            else if(!strcmp(optarg, "skip"))
+                tickcatchup = 0;
+            else
+                usage();
+            break;
+
+        case 'H':
+            histdepth = strtol(optarg, &s, 10);
+            if(*s != '\0' || histdepth < 0)
                 usage();
             break;
 
@@ -759,6 +4006,8 @@ main(int argc, char **argv)
 
     signal(SIGINT, sigint);
 
+    slab_setup();
+
     qidpath = 0;
     root = npfile_alloc(NULL, strdup(""), 0755|Dmdir, qidpath++, &dirops,
                         file_alloc());
@@ -771,12 +4020,33 @@ main(int argc, char **argv)
     root->gid = user->dfltgroup;
     root->muid = user;
 
-    Npfid dummyfid;
-    dummyfid.aux = root;
-    dummyfid.user = user;
-    npfile_create(&dummyfid, npstr_of_str("clock"), 0666, 0, npstr_of_str(""));
+    /* the clock makes the root a domain, which the stats file joins */
+    syncfs_mkfile(user, "clock", 0666);
+    rootdom = ((File *) root->aux)->dom;
+    statsfile = syncfs_mkfile(user, "stats", 0444);
+    snapfile = npfile_alloc(root, ".snapshot", 0444, qidpath++, &snapshotops,
+                            file_alloc());
+    npfile_incref(snapfile);
+    snapfile->uid = user;
+    snapfile->gid = user->dfltgroup;
+    snapfile->muid = user;
+    batchfile = npfile_alloc(root, ".batch", 0666, qidpath++, &batchops,
+                             file_alloc());
+    npfile_incref(batchfile);
+    batchfile->uid = user;
+    batchfile->gid = user->dfltgroup;
+    batchfile->muid = user;
+    zerochunk = calloc(1, blksize);
+
+    pthread_t reclaimtid;
+    if(!pools_start() ||
+       pthread_create(&reclaimtid, NULL, syncfs_reclaim_proc, NULL)) {
+        fprintf(stderr, "cannot start threads\n");
+        return -1;
+    }
+    pthread_detach(reclaimtid);
 
-    srv = np_socksrv_create_tcp(nwthreads, &port);
+    srv = np_socksrv_create_tcp(nwthreads, npollthreads, &port);
     if(!srv)
         return -1;
 
@@ -784,62 +4054,17 @@ main(int argc, char **argv)
     srv->connclose = syncfs_connclose;
     npfile_init_srv(srv, root);
     srv->stat = syncfs_stat;
+    srv->flush = syncfs_flush;
+    srv->walk = syncfs_walk;
+    srv->open = syncfs_fidopen;
+    srv->wstat = syncfs_fidwstat;
+    srv->remove = syncfs_fidremove;
+    srv->clone = syncfs_clone;
+    srv->fiddestroy = syncfs_fiddestroy;
 
     np_srv_start(srv);
 
-    struct timespec last;
-    clock_gettime(CLOCK_REALTIME, &last);
-
-    clkfile = npfile_find(root, "clock");
-    File *f = clkfile->aux;
-    u64 clkval = 0;
-    for(;;) {
-        struct timespec start;
-        clock_gettime(CLOCK_REALTIME, &start);
-
-        char clkstr[64], clkstrlen;
-        sprintf(clkstr, "{\"clock\":%ld,\"interval\":%ld}\n",
-                        (long int) clkval, clkperiod);
-        clkstrlen = strlen(clkstr);
-
-        FileRev *fr = filerev_alloc();
-        filerev_truncate(fr, clkstrlen);
-        memcpy(fr->data, clkstr, clkstrlen);
-        fr->length = clkstrlen;
-
-        pthread_mutex_lock(&f->wlock);
-        if(f->fr_write)
-            filerev_unref(f->fr_write);
-        f->fr_write = fr;
-        pthread_mutex_unlock(&f->wlock);
-
-        filecommits_add(clkfile);
-
-        syncfs_commit();
-
-        syncfs_release_clockstaters();
-
-        struct timespec now;
-        clock_gettime(CLOCK_REALTIME, &now);
-
-        struct timespec diff1;
-        timespec_subtract(&diff1, &now, &last);
-
-        memcpy(&last, &now, sizeof(struct timespec));
-
-        struct timespec diff2;
-        timespec_subtract(&diff2, &now, &start);
-
-//        printf("%ld\n", diff1.tv_nsec);
-//        printf("%ld\n", diff2.tv_nsec);
-
-        struct timespec wait;
-        wait.tv_sec = 0;
-        wait.tv_nsec = clkperiod - diff2.tv_nsec;
-        pthread_nanosleep(&wait, NULL);
-
-        clkval++;
-    }
+    domain_tick(rootdom);
 
     return 0;
 }
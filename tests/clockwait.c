@@ -0,0 +1,135 @@
+#include <config.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "p9client.h"
+
+/* Park many Tstats of the clock file across a few connections and measure
+ * how long it takes from the first waiter being answered to the last.  The
+ * first reply stands in for the tick, so the spread is the cost of releasing
+ * every waiter. */
+
+struct Waiters {
+    P9conn *conn;
+    int count;
+    struct timeval first;
+    struct timeval last;
+    int failed;
+};
+typedef struct Waiters Waiters;
+
+static pthread_barrier_t barrier;
+
+static double timeval_diff(struct timeval *x, struct timeval *y) {
+    return (x->tv_sec - y->tv_sec) * 1000000.0 + (x->tv_usec - y->tv_usec);
+}
+
+static void *waiters_proc(void *a) {
+    int i, type;
+    uint16_t tag;
+    uint8_t *body;
+    uint32_t bodylen;
+    Waiters *w = a;
+
+    /* sync to a tick so every Tstat below is parked on the same one */
+    if(p9_stat(w->conn, 1) < 0)
+        w->failed = 1;
+    pthread_barrier_wait(&barrier);
+    if(w->failed)
+        return NULL;
+
+    for(i = 0; i < w->count; i++)
+        if(p9_send_stat(w->conn, i, 1) < 0) {
+            w->failed = 1;
+            return NULL;
+        }
+
+    for(i = 0; i < w->count; i++) {
+        type = p9_recv(w->conn, &tag, &body, &bodylen);
+        if(type != P9_RSTAT) {
+            w->failed = 1;
+            return NULL;
+        }
+
+        if(i == 0)
+            gettimeofday(&w->first, NULL);
+    }
+    gettimeofday(&w->last, NULL);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 6) {
+        printf("Usage: clockwait [host] [port] [connections] [waiters] "
+               "[trials]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *host = argv[1];
+    int port = strtol(argv[2], NULL, 10);
+    int nconns = strtol(argv[3], NULL, 10);
+    int nwaiters = strtol(argv[4], NULL, 10);
+    int trials = strtol(argv[5], NULL, 10);
+
+    if(nconns < 1 || nwaiters < nconns || nwaiters / nconns >= 0xffff) {
+        printf("clockwait: need at least one waiter per connection and "
+               "fewer than 65535 per connection\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Waiters *w = calloc(nconns, sizeof(Waiters));
+    pthread_t *threads = calloc(nconns, sizeof(pthread_t));
+
+    int c;
+    for(c = 0; c < nconns; c++) {
+        w[c].conn = p9_connect(host, port);
+        if(!w[c].conn) {
+            fprintf(stderr, "clockwait: cannot connect to %s:%d\n", host,
+                    port);
+            exit(EXIT_FAILURE);
+        }
+
+        if(p9_attach(w[c].conn, 0, "nobody") < 0 ||
+           p9_walk(w[c].conn, 0, 1, "clock") < 0) {
+            fprintf(stderr, "clockwait: %s\n", w[c].conn->error);
+            exit(EXIT_FAILURE);
+        }
+
+        w[c].count = nwaiters / nconns + (c < nwaiters % nconns ? 1 : 0);
+    }
+
+    int t;
+    for(t = 0; t < trials; t++) {
+        pthread_barrier_init(&barrier, NULL, nconns);
+        for(c = 0; c < nconns; c++)
+            pthread_create(&threads[c], NULL, waiters_proc, &w[c]);
+        for(c = 0; c < nconns; c++)
+            pthread_join(threads[c], NULL);
+        pthread_barrier_destroy(&barrier);
+
+        struct timeval first = w[0].first, last = w[0].last;
+        for(c = 0; c < nconns; c++) {
+            if(w[c].failed) {
+                fprintf(stderr, "clockwait: connection %d failed\n", c);
+                exit(EXIT_FAILURE);
+            }
+
+            if(timeval_diff(&w[c].first, &first) < 0)
+                first = w[c].first;
+            if(timeval_diff(&w[c].last, &last) > 0)
+                last = w[c].last;
+        }
+
+        printf("%d\n", (int) timeval_diff(&last, &first));
+    }
+
+    for(c = 0; c < nconns; c++)
+        p9_close(w[c].conn);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "p9client.h"
+
+/* Dirty a growing number of files every tick and report how long the server
+ * took to commit them, as published in its stats file.  File counts go up by
+ * ten times from 1000 to max-files.  The files are spread over directories of
+ * GROUPFILES each, one connection per directory, since both creating a file
+ * and finding a fid search lists that grow with their number. */
+
+#define GROUPFILES 1000
+
+static char statbuf[8192];
+
+/* Pull "key":value out of the object named section in the stats file */
+static unsigned long long stats_get(P9conn *c, uint32_t fid,
+                                    const char *section, const char *key) {
+    int n;
+    char *p;
+
+    n = p9_read(c, fid, 0, statbuf, sizeof(statbuf) - 1);
+    if(n < 0)
+        return 0;
+    statbuf[n] = '\0';
+
+    p = strstr(statbuf, section);
+    if(!p)
+        return 0;
+    p = strstr(p, key);
+    if(!p)
+        return 0;
+
+    return strtoull(p + strlen(key), NULL, 10);
+}
+
+/* Connection g holds the files of directory g as fids 1 and up */
+static P9conn *group_create(char *host, int port, int g) {
+    char name[32], file[32];
+    int i;
+    P9conn *c;
+
+    c = p9_connect(host, port);
+    if(!c) {
+        fprintf(stderr, "commitscale: cannot connect to %s:%d\n", host, port);
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(name, sizeof(name), "commitscale_%d", g);
+    if(p9_attach(c, 0, "nobody") < 0 || p9_walk(c, 0, 1, "") < 0 ||
+       p9_create(c, 1, name, P9_DMDIR | 0777, 0) < 0 || p9_clunk(c, 1) < 0) {
+        fprintf(stderr, "commitscale: cannot create %s: %s\n", name,
+                c->error);
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < GROUPFILES; i++) {
+        snprintf(file, sizeof(file), "%d", i);
+        if(p9_walk(c, 0, 1 + i, name) < 0 ||
+           p9_create(c, 1 + i, file, 0666, 1) < 0) {
+            fprintf(stderr, "commitscale: cannot create %s/%s: %s\n", name,
+                    file, c->error);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return c;
+}
+
+static void group_remove(P9conn *c, int g) {
+    char name[32];
+    int i;
+
+    for(i = 0; i < GROUPFILES; i++)
+        p9_remove(c, 1 + i);
+
+    snprintf(name, sizeof(name), "commitscale_%d", g);
+    if(p9_walk(c, 0, 1, name) == 0)
+        p9_remove(c, 1);
+    p9_close(c);
+}
+
+/* Write one byte to every file of the group, all in flight at once */
+static int group_dirty(P9conn *c) {
+    int i, type;
+    uint16_t tag;
+    uint8_t *body;
+    uint32_t bodylen;
+
+    for(i = 0; i < GROUPFILES; i++)
+        if(p9_send_write(c, i, 1 + i, 0, "x", 1) < 0)
+            return -1;
+
+    for(i = 0; i < GROUPFILES; i++) {
+        type = p9_recv(c, &tag, &body, &bodylen);
+        if(type < 0 || type == P9_RERROR)
+            return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 5) {
+        printf("Usage: commitscale [host] [port] [max-files] [rounds]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *host = argv[1];
+    int port = strtol(argv[2], NULL, 10);
+    int maxfiles = strtol(argv[3], NULL, 10);
+    int rounds = strtol(argv[4], NULL, 10);
+
+    if(maxfiles < GROUPFILES || rounds < 1) {
+        printf("commitscale: need at least %d files and one round\n",
+               GROUPFILES);
+        exit(EXIT_FAILURE);
+    }
+
+    /* fid 1 is the clock and 2 the stats file */
+    P9conn *c = p9_connect(host, port);
+    if(!c || p9_attach(c, 0, "nobody") < 0 ||
+       p9_walk(c, 0, 1, "clock") < 0 || p9_walk(c, 0, 2, "stats") < 0 ||
+       p9_open(c, 2, 0) < 0) {
+        fprintf(stderr, "commitscale: %s\n", c ? c->error : "cannot connect");
+        exit(EXIT_FAILURE);
+    }
+
+    int ngroups = maxfiles / GROUPFILES;
+    P9conn **groups = calloc(ngroups, sizeof(P9conn *));
+
+    int g, i, n = 0;
+    printf("files mean-us max-us\n");
+    for(int files = GROUPFILES; files <= maxfiles; files *= 10) {
+        for(; n < files / GROUPFILES; n++)
+            groups[n] = group_create(host, port, n);
+
+        unsigned long long total = 0, max = 0;
+        for(i = 0; i < rounds; i++) {
+            /* start on a tick so the writes get a whole period; they are
+             * committed by the tick that answers the next Tstat, and the
+             * stats published by the one after that describe it */
+            if(p9_stat(c, 1) < 0) {
+                fprintf(stderr, "commitscale: %s\n", c->error);
+                exit(EXIT_FAILURE);
+            }
+
+            for(g = 0; g < n; g++)
+                if(group_dirty(groups[g]) < 0) {
+                    fprintf(stderr, "commitscale: write failed\n");
+                    exit(EXIT_FAILURE);
+                }
+
+            if(p9_stat(c, 1) < 0 || p9_stat(c, 1) < 0) {
+                fprintf(stderr, "commitscale: %s\n", c->error);
+                exit(EXIT_FAILURE);
+            }
+
+            if(stats_get(c, 2, "\"commit\"", "\"files\":") < files) {
+                fprintf(stderr, "commitscale: the writes took more than a "
+                        "tick, use a longer clock period\n");
+                exit(EXIT_FAILURE);
+            }
+
+            unsigned long long t = stats_get(c, 2, "\"commit\"", "\"last\":");
+            total += t;
+            if(t > max)
+                max = t;
+        }
+
+        printf("%d %llu %llu\n", files, total / rounds / 1000, max / 1000);
+        fflush(stdout);
+    }
+
+    for(g = 0; g < n; g++)
+        group_remove(groups[g], g);
+    p9_close(c);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "p9client.h"
+
+/* Try to remove each of the files the server provides in the root, both with
+ * a Tremove and by clunking a fid opened ORCLOSE, and check that every Tremove
+ * is refused with an error, that the server is still answering after each
+ * try and that the files are all still there at the end.  Removing .snapshot
+ * or .batch used to crash the server. */
+
+#define P9_ORCLOSE 0x40
+
+static char *ctlfiles[] = {
+    ".snapshot", ".batch", "clock", "participants", "changes",
+};
+
+/* Exit unless the server refused the removal and still answers */
+static void check_refused(P9conn *c, const char *name, const char *how,
+                          int ret) {
+    if(ret == 0) {
+        fprintf(stderr, "ctlremove: %s of %s succeeded\n", how, name);
+        exit(EXIT_FAILURE);
+    }
+    if(c->error[0] == '\0') {
+        fprintf(stderr, "ctlremove: no reply to %s of %s, is the server "
+                "still up?\n", how, name);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s %s: %s\n", how, name, c->error);
+}
+
+static void walk(P9conn *c, uint32_t newfid, const char *name) {
+    if(p9_walk(c, 0, newfid, name) < 0) {
+        fprintf(stderr, "ctlremove: cannot walk to %s: %s\n", name,
+                c->error);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        printf("Usage: ctlremove [host] [port]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *host = argv[1];
+    int port = strtol(argv[2], NULL, 10);
+
+    P9conn *c = p9_connect(host, port);
+    if(!c || p9_attach(c, 0, "nobody") < 0) {
+        fprintf(stderr, "ctlremove: %s\n", c ? c->error : "cannot connect");
+        exit(EXIT_FAILURE);
+    }
+
+    /* a failed Tremove leaves its fid behind, so every try gets a new one */
+    uint32_t fid = 1;
+    int i, mode;
+    for(i = 0; i < sizeof(ctlfiles) / sizeof(ctlfiles[0]); i++) {
+        walk(c, fid, ctlfiles[i]);
+        c->error[0] = '\0';
+        check_refused(c, ctlfiles[i], "remove", p9_remove(c, fid++));
+
+        /* participants can only be opened for writing */
+        mode = strcmp(ctlfiles[i], "participants") ? 0 : 1;
+        walk(c, fid, ctlfiles[i]);
+        c->error[0] = '\0';
+        if(p9_open(c, fid, mode | P9_ORCLOSE) < 0)
+            check_refused(c, ctlfiles[i], "open orclose", -1);
+        else if(p9_clunk(c, fid) < 0 && c->error[0] == '\0') {
+            /* the clunk itself need not fail, only leave the file be */
+            fprintf(stderr, "ctlremove: no reply to orclose of %s, is the "
+                    "server still up?\n", ctlfiles[i]);
+            exit(EXIT_FAILURE);
+        }
+        fid++;
+    }
+
+    /* the files are all still there */
+    for(i = 0; i < sizeof(ctlfiles) / sizeof(ctlfiles[0]); i++)
+        walk(c, fid++, ctlfiles[i]);
+
+    p9_close(c);
+    printf("ok\n");
+    return EXIT_SUCCESS;
+}
@@ -66,6 +66,10 @@ int main(int argc, char *argv[]) {
         perror("write");
         exit(EXIT_FAILURE);
     }
+    if(ftruncate(fd, buf_size) < 0) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
 
     int i;
     for(i = 0; i < trials; i++) {
@@ -105,6 +109,10 @@ int main(int argc, char *argv[]) {
             perror("write");
             exit(EXIT_FAILURE);
         }
+        if(ftruncate(fd, buf_size) < 0) {
+            perror("ftruncate");
+            exit(EXIT_FAILURE);
+        }
     }
 
     exit(EXIT_SUCCESS);
@@ -0,0 +1,370 @@
+#include <config.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "p9client.h"
+
+#define P9_MSIZE 8216
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v) {
+    p = put32(p, (uint32_t) v);
+    return put32(p, (uint32_t) (v >> 32));
+}
+
+static uint8_t *putstr(uint8_t *p, const char *s, int len) {
+    p = put16(p, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static int writeall(int fd, const uint8_t *buf, int len) {
+    int n;
+
+    while(len > 0) {
+        n = write(fd, buf, len);
+        if(n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Fill in the header of the message being built in c->obuf and send it */
+static int p9_send(P9conn *c, uint8_t type, uint16_t tag, uint8_t *end) {
+    uint32_t size;
+
+    size = end - c->obuf;
+    put32(c->obuf, size);
+    c->obuf[4] = type;
+    put16(c->obuf + 5, tag);
+
+    return writeall(c->fd, c->obuf, size);
+}
+
+int p9_recv(P9conn *c, uint16_t *tag, uint8_t **body, uint32_t *bodylen) {
+    int n;
+    uint32_t size;
+    uint8_t *msg;
+
+    for(;;) {
+        if(c->ilen - c->ipos >= 4) {
+            size = get32(c->ibuf + c->ipos);
+            if(size < 7 || size > c->msize)
+                return -1;
+
+            if(c->ilen - c->ipos >= size) {
+                msg = c->ibuf + c->ipos;
+                c->ipos += size;
+                *tag = get16(msg + 5);
+                *body = msg + 7;
+                *bodylen = size - 7;
+                return msg[4];
+            }
+        }
+
+        if(c->ipos > 0) {
+            memmove(c->ibuf, c->ibuf + c->ipos, c->ilen - c->ipos);
+            c->ilen -= c->ipos;
+            c->ipos = 0;
+        }
+
+        n = read(c->fd, c->ibuf + c->ilen, 2 * c->msize - c->ilen);
+        if(n <= 0)
+            return -1;
+        c->ilen += n;
+    }
+}
+
+/* Wait for the reply to a synchronous request */
+static int p9_rpc(P9conn *c, uint8_t type, uint16_t tag, uint8_t *end,
+                  uint8_t **body, uint32_t *bodylen) {
+    int rtype, n;
+    uint16_t rtag;
+
+    if(p9_send(c, type, tag, end) < 0)
+        return -1;
+
+    rtype = p9_recv(c, &rtag, body, bodylen);
+    if(rtype < 0 || rtag != tag)
+        return -1;
+
+    if(rtype == P9_RERROR) {
+        n = get16(*body);
+        if(n >= sizeof(c->error))
+            n = sizeof(c->error) - 1;
+        memcpy(c->error, *body + 2, n);
+        c->error[n] = '\0';
+        return -1;
+    }
+
+    return rtype;
+}
+
+static uint16_t p9_tag(P9conn *c) {
+    c->tag++;
+    if(c->tag == (uint16_t) ~0)
+        c->tag = 0;
+    return c->tag;
+}
+
+P9conn *p9_connect(const char *host, int port) {
+    int one;
+    uint8_t *p, *body;
+    uint32_t bodylen;
+    P9conn *c;
+    struct hostent *he;
+    struct sockaddr_in addr;
+
+    he = gethostbyname(host);
+    if(!he)
+        return NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr, he->h_addr, he->h_length);
+
+    c = malloc(sizeof(P9conn));
+    c->fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(c->fd < 0 || connect(c->fd, (struct sockaddr *) &addr,
+                            sizeof(addr)) < 0) {
+        if(c->fd >= 0)
+            close(c->fd);
+        free(c);
+        return NULL;
+    }
+
+    one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->msize = P9_MSIZE;
+    c->tag = 0;
+    c->obuf = malloc(c->msize);
+    c->ibuf = malloc(2 * c->msize);
+    c->ilen = 0;
+    c->ipos = 0;
+    c->error[0] = '\0';
+
+    p = c->obuf + 7;
+    p = put32(p, c->msize);
+    p = putstr(p, "9P2000.u", 8);
+    if(p9_rpc(c, P9_TVERSION, (uint16_t) ~0, p, &body, &bodylen) < 0) {
+        p9_close(c);
+        return NULL;
+    }
+    c->msize = get32(body);
+
+    return c;
+}
+
+void p9_close(P9conn *c) {
+    close(c->fd);
+    free(c->obuf);
+    free(c->ibuf);
+    free(c);
+}
+
+int p9_attach(P9conn *c, uint32_t fid, const char *uname) {
+    uint8_t *p, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    p = put32(p, P9_NOFID);
+    p = putstr(p, uname, strlen(uname));
+    p = putstr(p, "", 0);
+    p = put32(p, ~0);
+
+    return p9_rpc(c, P9_TATTACH, p9_tag(c), p, &body, &bodylen) < 0 ? -1 : 0;
+}
+
+int p9_walk(P9conn *c, uint32_t fid, uint32_t newfid, const char *path) {
+    int nwname;
+    const char *s, *e;
+    uint8_t *p, *pn, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    p = put32(p, newfid);
+    pn = p;
+    p += 2;
+
+    nwname = 0;
+    for(s = path; *s; s = e) {
+        while(*s == '/')
+            s++;
+        for(e = s; *e && *e != '/'; e++)
+            ;
+        if(e > s) {
+            p = putstr(p, s, e - s);
+            nwname++;
+        }
+    }
+    put16(pn, nwname);
+
+    if(p9_rpc(c, P9_TWALK, p9_tag(c), p, &body, &bodylen) < 0)
+        return -1;
+
+    return get16(body) == nwname ? 0 : -1;
+}
+
+int p9_open(P9conn *c, uint32_t fid, uint8_t mode) {
+    uint8_t *p, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    *p++ = mode;
+
+    return p9_rpc(c, P9_TOPEN, p9_tag(c), p, &body, &bodylen) < 0 ? -1 : 0;
+}
+
+int p9_create(P9conn *c, uint32_t fid, const char *name, uint32_t perm,
+              uint8_t mode) {
+    uint8_t *p, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    p = putstr(p, name, strlen(name));
+    p = put32(p, perm);
+    *p++ = mode;
+    p = putstr(p, "", 0);
+
+    return p9_rpc(c, P9_TCREATE, p9_tag(c), p, &body, &bodylen) < 0 ? -1 : 0;
+}
+
+int p9_read(P9conn *c, uint32_t fid, uint64_t offset, void *buf,
+            uint32_t count) {
+    uint8_t *p, *body;
+    uint32_t bodylen, n;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    p = put64(p, offset);
+    p = put32(p, count);
+
+    if(p9_rpc(c, P9_TREAD, p9_tag(c), p, &body, &bodylen) < 0)
+        return -1;
+
+    n = get32(body);
+    if(n > count)
+        n = count;
+    memcpy(buf, body + 4, n);
+    return n;
+}
+
+int p9_write(P9conn *c, uint32_t fid, uint64_t offset, const void *buf,
+             uint32_t count) {
+    uint8_t *p, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    p = put64(p, offset);
+    p = put32(p, count);
+    memcpy(p, buf, count);
+    p += count;
+
+    if(p9_rpc(c, P9_TWRITE, p9_tag(c), p, &body, &bodylen) < 0)
+        return -1;
+
+    return get32(body);
+}
+
+int p9_stat(P9conn *c, uint32_t fid) {
+    uint8_t *p, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+
+    return p9_rpc(c, P9_TSTAT, p9_tag(c), p, &body, &bodylen) < 0 ? -1 : 0;
+}
+
+int p9_clunk(P9conn *c, uint32_t fid) {
+    uint8_t *p, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+
+    return p9_rpc(c, P9_TCLUNK, p9_tag(c), p, &body, &bodylen) < 0 ? -1 : 0;
+}
+
+int p9_remove(P9conn *c, uint32_t fid) {
+    uint8_t *p, *body;
+    uint32_t bodylen;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+
+    return p9_rpc(c, P9_TREMOVE, p9_tag(c), p, &body, &bodylen) < 0 ? -1 : 0;
+}
+
+int p9_send_stat(P9conn *c, uint16_t tag, uint32_t fid) {
+    uint8_t *p;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+
+    return p9_send(c, P9_TSTAT, tag, p);
+}
+
+int p9_send_read(P9conn *c, uint16_t tag, uint32_t fid, uint64_t offset,
+                 uint32_t count) {
+    uint8_t *p;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    p = put64(p, offset);
+    p = put32(p, count);
+
+    return p9_send(c, P9_TREAD, tag, p);
+}
+
+int p9_send_write(P9conn *c, uint16_t tag, uint32_t fid, uint64_t offset,
+                  const void *buf, uint32_t count) {
+    uint8_t *p;
+
+    p = c->obuf + 7;
+    p = put32(p, fid);
+    p = put64(p, offset);
+    p = put32(p, count);
+    memcpy(p, buf, count);
+    p += count;
+
+    return p9_send(c, P9_TWRITE, tag, p);
+}
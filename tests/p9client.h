@@ -0,0 +1,67 @@
+/* A minimal 9P2000.u client used by the benchmarks that talk to syncfs over
+ * TCP instead of through a mount point.  Every call is synchronous except
+ * the p9_send_* functions, whose replies are collected with p9_recv so that
+ * many requests can be outstanding on one connection.
+ */
+#ifndef P9CLIENT_H
+#define P9CLIENT_H
+
+#include <stdint.h>
+
+#define P9_NOFID    (uint32_t)(~0)
+#define P9_DMDIR    0x80000000
+
+enum {
+    P9_TVERSION = 100,
+    P9_TATTACH  = 104,
+    P9_RERROR   = 107,
+    P9_TFLUSH   = 108,
+    P9_TWALK    = 110,
+    P9_TOPEN    = 112,
+    P9_TCREATE  = 114,
+    P9_TREAD    = 116,
+    P9_RREAD    = 117,
+    P9_TWRITE   = 118,
+    P9_TCLUNK   = 120,
+    P9_TREMOVE  = 122,
+    P9_TSTAT    = 124,
+    P9_RSTAT    = 125,
+};
+
+typedef struct P9conn P9conn;
+
+struct P9conn {
+    int fd;
+    uint32_t msize;
+    uint16_t tag;
+    uint8_t *obuf;
+    uint8_t *ibuf;
+    int ilen;           /* bytes buffered in ibuf */
+    int ipos;           /* start of the next unread message */
+    char error[128];    /* ename of the last Rerror */
+};
+
+P9conn *p9_connect(const char *host, int port);
+void p9_close(P9conn *c);
+
+int p9_attach(P9conn *c, uint32_t fid, const char *uname);
+int p9_walk(P9conn *c, uint32_t fid, uint32_t newfid, const char *path);
+int p9_open(P9conn *c, uint32_t fid, uint8_t mode);
+int p9_create(P9conn *c, uint32_t fid, const char *name, uint32_t perm,
+              uint8_t mode);
+int p9_read(P9conn *c, uint32_t fid, uint64_t offset, void *buf,
+            uint32_t count);
+int p9_write(P9conn *c, uint32_t fid, uint64_t offset, const void *buf,
+             uint32_t count);
+int p9_stat(P9conn *c, uint32_t fid);
+int p9_clunk(P9conn *c, uint32_t fid);
+int p9_remove(P9conn *c, uint32_t fid);
+
+int p9_send_stat(P9conn *c, uint16_t tag, uint32_t fid);
+int p9_send_read(P9conn *c, uint16_t tag, uint32_t fid, uint64_t offset,
+                 uint32_t count);
+int p9_send_write(P9conn *c, uint16_t tag, uint32_t fid, uint64_t offset,
+                  const void *buf, uint32_t count);
+int p9_recv(P9conn *c, uint16_t *tag, uint8_t **body, uint32_t *bodylen);
+
+#endif
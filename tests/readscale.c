@@ -0,0 +1,146 @@
+#include <config.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "p9client.h"
+
+/* Read one file from a growing number of threads, each with its own
+ * connection, and report the aggregate Tread rate for each thread count. */
+
+struct Reader {
+    P9conn *conn;
+    int filesize;
+    long reads;
+    int failed;
+};
+typedef struct Reader Reader;
+
+static volatile int running;
+static pthread_barrier_t barrier;
+
+static double timeval_diff(struct timeval *x, struct timeval *y) {
+    return (x->tv_sec - y->tv_sec) + (x->tv_usec - y->tv_usec) / 1000000.0;
+}
+
+static void *reader_proc(void *a) {
+    Reader *r = a;
+    char *buf = malloc(r->filesize);
+
+    pthread_barrier_wait(&barrier);
+    while(running) {
+        if(p9_read(r->conn, 1, 0, buf, r->filesize) != r->filesize) {
+            r->failed = 1;
+            break;
+        }
+        r->reads++;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static P9conn *open_file(char *host, int port, char *name, int mode) {
+    P9conn *c = p9_connect(host, port);
+    if(!c) {
+        fprintf(stderr, "readscale: cannot connect to %s:%d\n", host, port);
+        exit(EXIT_FAILURE);
+    }
+
+    if(p9_attach(c, 0, "nobody") < 0 || p9_walk(c, 0, 1, name) < 0 ||
+       p9_open(c, 1, mode) < 0) {
+        fprintf(stderr, "readscale: %s\n", c->error);
+        exit(EXIT_FAILURE);
+    }
+
+    return c;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 6) {
+        printf("Usage: readscale [host] [port] [filesize] [seconds] "
+               "[max-threads]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *host = argv[1];
+    int port = strtol(argv[2], NULL, 10);
+    int filesize = strtol(argv[3], NULL, 10);
+    int seconds = strtol(argv[4], NULL, 10);
+    int maxthreads = strtol(argv[5], NULL, 10);
+
+    if(filesize < 1 || filesize > 8192 || maxthreads < 1) {
+        printf("readscale: filesize must be 1 to 8192 bytes\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* create the file and wait a tick for it to be committed */
+    P9conn *c = p9_connect(host, port);
+    if(!c || p9_attach(c, 0, "nobody") < 0 ||
+       p9_walk(c, 0, 1, "") < 0 ||
+       p9_create(c, 1, "readscale_test", 0666, 1) < 0) {
+        fprintf(stderr, "readscale: cannot create test file: %s\n",
+                c ? c->error : "cannot connect");
+        exit(EXIT_FAILURE);
+    }
+
+    char *data = malloc(filesize);
+    memset(data, 'r', filesize);
+    if(p9_write(c, 1, 0, data, filesize) != filesize ||
+       p9_walk(c, 0, 2, "clock") < 0 || p9_stat(c, 2) < 0 ||
+       p9_stat(c, 2) < 0) {
+        fprintf(stderr, "readscale: %s\n", c->error);
+        exit(EXIT_FAILURE);
+    }
+
+    Reader *readers = calloc(maxthreads, sizeof(Reader));
+    pthread_t *threads = calloc(maxthreads, sizeof(pthread_t));
+
+    int i, n;
+    for(i = 0; i < maxthreads; i++) {
+        readers[i].conn = open_file(host, port, "readscale_test", 0);
+        readers[i].filesize = filesize;
+    }
+
+    printf("threads reads/s\n");
+    for(n = 1; n <= maxthreads; n *= 2) {
+        running = 1;
+        pthread_barrier_init(&barrier, NULL, n + 1);
+        for(i = 0; i < n; i++) {
+            readers[i].reads = 0;
+            pthread_create(&threads[i], NULL, reader_proc, &readers[i]);
+        }
+
+        struct timeval start, end;
+        pthread_barrier_wait(&barrier);
+        gettimeofday(&start, NULL);
+        sleep(seconds);
+        running = 0;
+
+        long reads = 0;
+        for(i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+            if(readers[i].failed) {
+                fprintf(stderr, "readscale: read failed\n");
+                exit(EXIT_FAILURE);
+            }
+            reads += readers[i].reads;
+        }
+        gettimeofday(&end, NULL);
+        pthread_barrier_destroy(&barrier);
+
+        printf("%d %.0f\n", n, reads / timeval_diff(&end, &start));
+        fflush(stdout);
+    }
+
+    for(i = 0; i < maxthreads; i++)
+        p9_close(readers[i].conn);
+    p9_remove(c, 1);
+    p9_close(c);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "p9client.h"
+
+/* Start syncfs on a growing number of cores, doubling from 1 to max-cores,
+ * and report how many small Treads a second it answers for a fixed set of
+ * connections that each keep DEPTH reads in flight.  The server is pinned
+ * to the cores with its CPU affinity, so this measures how request dispatch
+ * scales rather than how the client does; run the client on other cores. */
+
+#define DEPTH       16
+#define FILESIZE    64
+
+struct Client {
+    P9conn *conn;
+    long reads;
+    int failed;
+};
+typedef struct Client Client;
+
+static volatile int running;
+static pthread_barrier_t barrier;
+
+static double timeval_diff(struct timeval *x, struct timeval *y) {
+    return (x->tv_sec - y->tv_sec) + (x->tv_usec - y->tv_usec) / 1000000.0;
+}
+
+static void *client_proc(void *a) {
+    int i, type;
+    uint16_t tag;
+    uint8_t *body;
+    uint32_t bodylen;
+    Client *cl = a;
+
+    pthread_barrier_wait(&barrier);
+    for(i = 0; i < DEPTH; i++)
+        if(p9_send_read(cl->conn, i, 1, 0, FILESIZE) < 0)
+            cl->failed = 1;
+
+    /* answer each reply with another read until told to stop, then
+     * collect what is still in flight */
+    for(i = DEPTH; i > 0 && !cl->failed;) {
+        type = p9_recv(cl->conn, &tag, &body, &bodylen);
+        if(type != P9_RREAD) {
+            cl->failed = 1;
+            break;
+        }
+        cl->reads++;
+
+        if(!running)
+            i--;
+        else if(p9_send_read(cl->conn, tag, 1, 0, FILESIZE) < 0)
+            cl->failed = 1;
+    }
+
+    return NULL;
+}
+
+static pid_t server_start(char *syncfs, int port, int cores) {
+    char portstr[16];
+    cpu_set_t set;
+    int i;
+    pid_t pid;
+
+    pid = fork();
+    if(pid < 0) {
+        perror("reqscale: fork");
+        exit(EXIT_FAILURE);
+    }
+    if(pid > 0)
+        return pid;
+
+    CPU_ZERO(&set);
+    for(i = 0; i < cores; i++)
+        CPU_SET(i, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("reqscale: sched_setaffinity");
+        _exit(EXIT_FAILURE);
+    }
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    execl(syncfs, syncfs, "-n", "-p", portstr, (char *) NULL);
+    perror("reqscale: exec");
+    _exit(EXIT_FAILURE);
+}
+
+static P9conn *server_connect(char *host, int port) {
+    int i;
+    P9conn *c;
+
+    for(i = 0; i < 100; i++) {
+        c = p9_connect(host, port);
+        if(c)
+            return c;
+        usleep(50000);
+    }
+
+    fprintf(stderr, "reqscale: cannot connect to %s:%d\n", host, port);
+    exit(EXIT_FAILURE);
+}
+
+static void server_check(P9conn *c, int ret) {
+    if(ret < 0) {
+        fprintf(stderr, "reqscale: %s\n", c->error);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 6) {
+        printf("Usage: reqscale [syncfs] [port] [seconds] [max-cores] "
+               "[connections]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *syncfs = argv[1];
+    int port = strtol(argv[2], NULL, 10);
+    int seconds = strtol(argv[3], NULL, 10);
+    int maxcores = strtol(argv[4], NULL, 10);
+    int nclients = strtol(argv[5], NULL, 10);
+
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(maxcores > ncpus) {
+        printf("reqscale: only %d cores online\n", ncpus);
+        maxcores = ncpus;
+    }
+    if(maxcores < 1 || nclients < 1 || seconds < 1) {
+        printf("reqscale: need a core, a connection and a second\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Client *clients = calloc(nclients, sizeof(Client));
+    pthread_t *threads = calloc(nclients, sizeof(pthread_t));
+    char data[FILESIZE];
+    memset(data, 'r', sizeof(data));
+
+    int cores, i, status;
+    printf("cores reads/s\n");
+    for(cores = 1; cores <= maxcores; cores *= 2) {
+        pid_t pid = server_start(syncfs, port, cores);
+
+        /* create the file and wait a tick for it to be committed */
+        P9conn *c = server_connect("localhost", port);
+        server_check(c, p9_attach(c, 0, "nobody"));
+        server_check(c, p9_walk(c, 0, 1, ""));
+        server_check(c, p9_create(c, 1, "reqscale_test", 0666, 1));
+        server_check(c, p9_write(c, 1, 0, data, sizeof(data)));
+        server_check(c, p9_walk(c, 0, 2, "clock"));
+        server_check(c, p9_stat(c, 2));
+        server_check(c, p9_stat(c, 2));
+
+        for(i = 0; i < nclients; i++) {
+            clients[i].conn = server_connect("localhost", port);
+            clients[i].reads = 0;
+            clients[i].failed = 0;
+            server_check(clients[i].conn,
+                         p9_attach(clients[i].conn, 0, "nobody"));
+            server_check(clients[i].conn,
+                         p9_walk(clients[i].conn, 0, 1, "reqscale_test"));
+            server_check(clients[i].conn, p9_open(clients[i].conn, 1, 0));
+        }
+
+        running = 1;
+        pthread_barrier_init(&barrier, NULL, nclients + 1);
+        for(i = 0; i < nclients; i++)
+            pthread_create(&threads[i], NULL, client_proc, &clients[i]);
+
+        struct timeval start, end;
+        pthread_barrier_wait(&barrier);
+        gettimeofday(&start, NULL);
+        sleep(seconds);
+        running = 0;
+
+        long reads = 0;
+        for(i = 0; i < nclients; i++) {
+            pthread_join(threads[i], NULL);
+            if(clients[i].failed) {
+                fprintf(stderr, "reqscale: read failed\n");
+                exit(EXIT_FAILURE);
+            }
+            reads += clients[i].reads;
+            p9_close(clients[i].conn);
+        }
+        gettimeofday(&end, NULL);
+        pthread_barrier_destroy(&barrier);
+        p9_close(c);
+
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+
+        printf("%d %.0f\n", cores, reads / timeval_diff(&end, &start));
+        fflush(stdout);
+    }
+
+    free(clients);
+    free(threads);
+
+    return EXIT_SUCCESS;
+}